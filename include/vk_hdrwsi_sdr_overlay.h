@@ -0,0 +1,48 @@
+#ifndef VK_HDRWSI_SDR_OVERLAY_H_
+#define VK_HDRWSI_SDR_OVERLAY_H_ 1
+
+#include <vulkan/vulkan.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// VK_HDRWSI_sdr_overlay is provided by VK_LAYER_hdr_wsi.
+//
+// Chaining VkWaylandSdrOverlaySurfaceCreateInfoHDRWSI into
+// VkWaylandSurfaceCreateInfoKHR::pNext creates the VkSurfaceKHR on a new
+// wl_subsurface of VkWaylandSurfaceCreateInfoKHR::surface instead of on that
+// surface itself. The subsurface is tagged as sRGB content, so an SDR UI can be
+// rendered into its own (usually smaller) swapchain and blended by the
+// compositor on top of the HDR swapchain of the parent surface, instead of
+// being composited into it by the application. How bright SDR white is shown
+// is up to the compositor.
+//
+// Requires VK_KHR_wayland_surface. The structure is ignored unless
+// VK_HDRWSI_sdr_overlay is enabled on the instance. It is also ignored, with
+// a warning, if the compositor doesn't offer wl_subcompositor: the
+// VkSurfaceKHR is then created on VkWaylandSurfaceCreateInfoKHR::surface
+// itself, as if the structure wasn't there.
+#define VK_HDRWSI_sdr_overlay 1
+#define VK_HDRWSI_SDR_OVERLAY_SPEC_VERSION 1
+#define VK_HDRWSI_SDR_OVERLAY_EXTENSION_NAME "VK_HDRWSI_sdr_overlay"
+
+// Private structure type, outside of any range allocated by Khronos.
+#define VK_STRUCTURE_TYPE_WAYLAND_SDR_OVERLAY_SURFACE_CREATE_INFO_HDRWSI ((VkStructureType)0x48445201)
+
+typedef struct VkWaylandSdrOverlaySurfaceCreateInfoHDRWSI {
+    VkStructureType sType;
+    const void*     pNext;
+    // Position of the overlay relative to the parent surface, in surface-local coordinates.
+    int32_t         x;
+    int32_t         y;
+    // VK_FALSE: overlay updates are applied together with the next commit of
+    // the parent surface. VK_TRUE: overlay updates are applied immediately.
+    VkBool32        desynchronized;
+} VkWaylandSdrOverlaySurfaceCreateInfoHDRWSI;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -2,13 +2,31 @@
 #include "vkroots.h"
 #include "color-management-v1-client-protocol.h"
 #include "color-representation-v1-client-protocol.h"
+#include "tearing-control-v1-client-protocol.h"
+#include "content-type-v1-client-protocol.h"
+#include "vk_hdrwsi_sdr_overlay.h"
+#include "hdr_wsi_trace.h"
 
 #include <cmath>
 #include <cstdio>
+#include <chrono>
+#include <cinttypes>
+#include <climits>
+#include <limits>
 #include <vector>
 #include <algorithm>
 #include <unordered_map>
 #include <optional>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <new>
+#include <type_traits>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 using namespace std::literals;
 
@@ -145,42 +163,459 @@ namespace HdrLayer
           .extended_volume = true,
       }};
 
+  static const ColorDescription *find_description(VkColorSpaceKHR colorSpace)
+  {
+    auto desc = std::find_if(s_ExtraHDRSurfaceFormats.begin(), s_ExtraHDRSurfaceFormats.end(),
+                             [=](const ColorDescription &value)
+                             { return value.surface.surfaceFormat.colorSpace == colorSpace; });
+    return desc != s_ExtraHDRSurfaceFormats.end() ? &*desc : nullptr;
+  }
+
+  // Anything an SDR output can't show as is: a volume beyond the primaries
+  // (scRGB and friends), BT.2020 primaries, ST 2084 (PQ) or ARIB STD-B67 (HLG).
+  static bool is_hdr(int primaries_cicp, int tf_cicp, bool extended_volume)
+  {
+    return extended_volume || primaries_cicp == 9 || tf_cicp == 16 || tf_cicp == 18;
+  }
+
+  static bool is_hdr(const ColorDescription &desc)
+  {
+    return is_hdr(desc.primaries_cicp, desc.tf_cicp, desc.extended_volume);
+  }
+
+  // HDR_WSI_TEARING_CONTROL=1 sends the tearing hint. Opt-in, as drivers
+  // that do this themselves (e.g. Mesa) make a second tearing control object
+  // for the surface a fatal protocol error.
+  static bool tearing_control_enabled()
+  {
+    static const bool s_enabled = []()
+    {
+      const char *env = getenv("HDR_WSI_TEARING_CONTROL");
+      return env && env == "1"sv;
+    }();
+    return s_enabled;
+  }
+
+  static constexpr uint32_t s_ContentTypeAuto = std::numeric_limits<uint32_t>::max();
+
+  // HDR_WSI_CONTENT_TYPE=none|photo|video|game sets the content type hint of
+  // every swapchain, auto tags low-latency (IMMEDIATE/MAILBOX) ones as game.
+  // Opt-in for the same reason, the app or its toolkit may own the object.
+  static std::optional<uint32_t> configured_content_type()
+  {
+    static const std::optional<uint32_t> s_contentType = []() -> std::optional<uint32_t>
+    {
+      const char *env = getenv("HDR_WSI_CONTENT_TYPE");
+      if (!env)
+        return std::nullopt;
+      if (env == "auto"sv)
+        return s_ContentTypeAuto;
+      if (env == "none"sv)
+        return WP_CONTENT_TYPE_V1_TYPE_NONE;
+      if (env == "photo"sv)
+        return WP_CONTENT_TYPE_V1_TYPE_PHOTO;
+      if (env == "video"sv)
+        return WP_CONTENT_TYPE_V1_TYPE_VIDEO;
+      if (env == "game"sv)
+        return WP_CONTENT_TYPE_V1_TYPE_GAME;
+
+      fprintf(stderr, "[HDR Layer] Unknown HDR_WSI_CONTENT_TYPE '%s', ignoring\n", env);
+      return std::nullopt;
+    }();
+    return s_contentType;
+  }
+
+  static double env_double(const char *name, double fallback)
+  {
+    const char *env = getenv(name);
+    if (!env)
+      return fallback;
+
+    char *end = nullptr;
+    double value = strtod(env, &end);
+    if (end == env || value < 0.0)
+    {
+      fprintf(stderr, "[HDR Layer] Invalid %s '%s', using %f\n", name, env, fallback);
+      return fallback;
+    }
+    return value;
+  }
+
+  // Some titles/translation layers call vkSetHdrMetadataEXT every frame with
+  // slightly jittering values (e.g. measured MaxFALL). Each accepted update
+  // costs a new image description and a pipeline rebuild in the compositor.
+  struct MetadataCoalescing
+  {
+    // A luminance value is significant once it moves by more than
+    // max(absThreshold nits, relThreshold * value) from the applied one.
+    double relThreshold;
+    double absThreshold;
+    // While a significant update is waiting for the rate limit, it is kept
+    // as long as values stay beyond hysteresis * threshold.
+    double hysteresis;
+    // Maximum description changes per second, 0 for unlimited.
+    double maxRate;
+  };
+
+  static const MetadataCoalescing &metadata_coalescing()
+  {
+    static const MetadataCoalescing s_config = {
+        .relThreshold = env_double("HDR_WSI_METADATA_REL_THRESHOLD", 0.05),
+        .absThreshold = env_double("HDR_WSI_METADATA_ABS_THRESHOLD", 2.0),
+        .hysteresis = env_double("HDR_WSI_METADATA_HYSTERESIS", 0.5),
+        .maxRate = env_double("HDR_WSI_METADATA_MAX_RATE", 4.0),
+    };
+    return s_config;
+  }
+
+  // Distance between two metadata sets in units of the coalescing threshold,
+  // >= 1 is a significant change. Chromaticities and the minimum luminance are
+  // only compared at the protocol precision.
+  static double metadata_distance(const VkHdrMetadataEXT &a, const VkHdrMetadataEXT &b, const MetadataCoalescing &config)
+  {
+    static constexpr double s_significant = std::numeric_limits<double>::max();
+
+    auto differs = [](float x, float y)
+    { return round(x * 10000.0) != round(y * 10000.0); };
+    auto differsXY = [=](VkXYColorEXT x, VkXYColorEXT y)
+    { return differs(x.x, y.x) || differs(x.y, y.y); };
+
+    if (differsXY(a.displayPrimaryRed, b.displayPrimaryRed) || differsXY(a.displayPrimaryGreen, b.displayPrimaryGreen) ||
+        differsXY(a.displayPrimaryBlue, b.displayPrimaryBlue) || differsXY(a.whitePoint, b.whitePoint) ||
+        differs(a.minLuminance, b.minLuminance))
+      return s_significant;
+
+    auto luminance = [&](float x, float y) -> double
+    {
+      double threshold = std::max(config.absThreshold, config.relThreshold * std::max(std::abs(x), std::abs(y)));
+      if (threshold <= 0.0)
+        return x != y ? s_significant : 0.0;
+      return std::abs(double(x) - double(y)) / threshold;
+    };
+
+    return std::max({
+        luminance(a.maxLuminance, b.maxLuminance),
+        luminance(a.maxContentLightLevel, b.maxContentLightLevel),
+        luminance(a.maxFrameAverageLightLevel, b.maxFrameAverageLightLevel),
+    });
+  }
+
+  struct MetadataStats
+  {
+    uint64_t received;
+    uint64_t applied;
+    uint64_t dropped; // absorbed as jitter around the applied value
+    uint64_t merged;  // superseded by a later update while rate limited
+  };
+
+  // HDR_WSI_TRACE=<path> records the WSI call stream into a memory-mapped
+  // file (see hdr_wsi_trace.h), HDR_WSI_TRACE_CAPACITY limits the record count.
+  // Every process gets its own <path>.<pid>, as the implicit layer is loaded
+  // into nested clients with the same environment.
+  static TraceHeader *trace_header()
+  {
+    static TraceHeader *s_header = []() -> TraceHeader *
+    {
+      const char *env = getenv("HDR_WSI_TRACE");
+      if (!env)
+        return nullptr;
+
+      char path[PATH_MAX];
+      snprintf(path, sizeof(path), "%s.%d", env, int(getpid()));
+
+      uint64_t capacity = uint64_t(env_double("HDR_WSI_TRACE_CAPACITY", 262144.0));
+      size_t size = sizeof(TraceHeader) + capacity * sizeof(TraceRecord);
+
+      int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+      if (fd < 0 || ftruncate(fd, off_t(size)) != 0)
+      {
+        fprintf(stderr, "[HDR Layer] Failed to create trace file %s: %s\n", path, strerror(errno));
+        if (fd >= 0)
+          close(fd);
+        return nullptr;
+      }
+      void *map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      close(fd);
+      if (map == MAP_FAILED)
+      {
+        fprintf(stderr, "[HDR Layer] Failed to map trace file %s: %s\n", path, strerror(errno));
+        return nullptr;
+      }
+
+      // Never unmapped, the kernel writes it back when the process exits
+      auto header = new (map) TraceHeader{};
+      memcpy(header->magic, s_TraceMagic, sizeof(s_TraceMagic));
+      header->version = s_TraceVersion;
+      header->recordSize = sizeof(TraceRecord);
+      header->capacity = capacity;
+
+      fprintf(stderr, "[HDR Layer] Recording trace to %s (%" PRIu64 " records)\n", path, capacity);
+      return header;
+    }();
+    return s_header;
+  }
+
+  template <typename T>
+  static uint64_t trace_handle(T handle)
+  {
+    if constexpr (std::is_pointer_v<T>)
+      return uint64_t(reinterpret_cast<uintptr_t>(handle));
+    else
+      return uint64_t(handle);
+  }
+
+  // Claims the next record, nullptr if tracing is disabled or the trace is full.
+  static TraceRecord *trace_append(TraceType type, uint64_t object, uint64_t parent, VkResult result)
+  {
+    TraceHeader *header = trace_header();
+    if (!header)
+      return nullptr;
+
+    uint64_t index = header->count.fetch_add(1, std::memory_order_relaxed);
+    if (index >= header->capacity)
+      return nullptr;
+
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    auto record = reinterpret_cast<TraceRecord *>(header + 1) + index;
+    record->timestampNs = uint64_t(ts.tv_sec) * 1000000000ull + uint64_t(ts.tv_nsec);
+    record->type = type;
+    record->result = int32_t(result);
+    record->object = object;
+    record->parent = parent;
+    return record;
+  }
+
+  // The handle is only valid, and only passed, on success
+  static void trace_swapchain(const VkSwapchainCreateInfoKHR *pCreateInfo, VkResult result, VkSwapchainKHR swapchain = VK_NULL_HANDLE)
+  {
+    if (auto record = trace_append(TraceType::CreateSwapchain, trace_handle(swapchain), trace_handle(pCreateInfo->surface), result))
+    {
+      record->swapchain = TraceSwapchainInfo{
+          .format = uint32_t(pCreateInfo->imageFormat),
+          .colorSpace = uint32_t(pCreateInfo->imageColorSpace),
+          .presentMode = uint32_t(pCreateInfo->presentMode),
+          .width = pCreateInfo->imageExtent.width,
+          .height = pCreateInfo->imageExtent.height,
+          .imageCount = pCreateInfo->minImageCount,
+      };
+    }
+  }
+
+  struct PreferredDescription
+  {
+    int primaries_cicp;
+    int tf_cicp;
+  };
+
   struct HdrSurfaceData
   {
     VkInstance instance;
 
     wl_display *display;
     wl_event_queue *queue;
+    // wl_display proxy on our queue, for syncs
+    wl_display *displayWrapper;
+    wl_registry *registry;
     wp_color_manager_v1 *colorManagement;
     wp_color_representation_manager_v1 *colorRepresentationMgr;
+    uint32_t colorManagementName;
+    uint32_t colorRepresentationName;
 
     std::vector<uint32_t> features;
     std::vector<uint32_t> tf_cicp;
     std::vector<uint32_t> primaries_cicp;
 
+    // Bumped whenever the color manager global is (re)bound or removed,
+    // image descriptions created from an older generation are dead.
+    uint32_t managerGeneration;
+    // Bumped whenever features, supported cicps or the preferred description change.
+    uint64_t capsSerial;
+    // Pending while the capabilities of a newly bound color manager are still being sent.
+    wl_callback *capsSync;
+
     wl_surface *surface;
     wp_color_management_surface_v1 *colorSurface;
     wp_color_representation_v1 *colorRepresentation;
+
+    PreferredDescription preferred;
+    PreferredDescription pendingPreferred;
+    wp_image_description_v1 *preferredDescription;
   };
   VKROOTS_DEFINE_SYNCHRONIZED_MAP_TYPE(HdrSurface, VkSurfaceKHR);
 
+  // Presentation hints, tracked for every surface (HDR or not) while one of them is enabled.
+  struct HintSurfaceData
+  {
+    wl_display *display;
+    wl_event_queue *queue;
+    wl_registry *registry;
+    wp_tearing_control_manager_v1 *tearingControlMgr;
+    wp_content_type_manager_v1 *contentTypeMgr;
+    uint32_t tearingControlName;
+    uint32_t contentTypeName;
+
+    wl_surface *surface;
+    // Created on the first swapchain that needs them
+    wp_tearing_control_v1 *tearingControl;
+    wp_content_type_v1 *contentType;
+  };
+  VKROOTS_DEFINE_SYNCHRONIZED_MAP_TYPE(HintSurface, VkSurfaceKHR);
+
+  static bool supports_description(const HdrSurfaceData &surface, const ColorDescription &desc)
+  {
+    return contains_u32(surface.tf_cicp, desc.tf_cicp) && contains_u32(surface.primaries_cicp, desc.primaries_cicp) && (!desc.extended_volume || contains_u32(surface.features, WP_COLOR_MANAGER_V1_FEATURE_EXTENDED_TARGET_VOLUME));
+  }
+
+  static bool supports_color_space(const HdrSurfaceData &surface, VkColorSpaceKHR colorSpace)
+  {
+    auto desc = find_description(colorSpace);
+    if (!desc)
+      return true; // untagged, nothing the compositor could reject
+
+    return surface.colorManagement && supports_description(surface, *desc);
+  }
+
+  // Reads whatever the compositor sent in the meantime into our queue, if the
+  // socket is readable. Must not be called with any of the map locks held:
+  // wl_display_read_events waits for every other thread that is about to read
+  // the display. The events are dispatched with wl_display_dispatch_queue_pending
+  // under the surface lock afterwards.
+  static void read_surface_events(wl_display *display, wl_event_queue *queue)
+  {
+    // Something is queued already, that's enough for now
+    if (wl_display_prepare_read_queue(display, queue) != 0)
+      return;
+    wl_display_flush(display);
+
+    pollfd pfd = {.fd = wl_display_get_fd(display), .events = POLLIN, .revents = 0};
+    if (poll(&pfd, 1, 0) > 0)
+      wl_display_read_events(display);
+    else
+      wl_display_cancel_read(display);
+  }
+
+  // Reads and dispatches whatever the compositor sent for the surface in the
+  // meantime, without blocking. Takes the surface lock itself, so the caller
+  // must not hold it.
+  static void dispatch_surface_events(VkSurfaceKHR surface)
+  {
+    wl_display *display = nullptr;
+    wl_event_queue *queue = nullptr;
+    if (auto hdrSurface = HdrSurface::get(surface))
+    {
+      display = hdrSurface->display;
+      queue = hdrSurface->queue;
+    }
+    if (!display)
+      return;
+
+    read_surface_events(display, queue);
+
+    auto hdrSurface = HdrSurface::get(surface);
+    if (hdrSurface)
+      wl_display_dispatch_queue_pending(display, queue);
+  }
+
+  enum DescStatus
+  {
+    WAITING,
+    READY,
+    FAILED,
+  };
+
   struct HdrSwapchainData
   {
     VkSurfaceKHR surface;
+    // Of the surface, to read events before taking its lock
+    wl_display *display;
+    wl_event_queue *queue;
+    VkColorSpaceKHR colorSpace;
     int primaries;
     int tf;
 
     wp_image_description_v1 *colorDescription;
     bool desc_dirty;
+    // Created without waiting for the compositor, replaces colorDescription
+    // on the first present after it is ready.
+    wp_image_description_v1 *pendingDescription;
+    DescStatus pendingStatus;
+    // Metadata of colorDescription, of pendingDescription and the latest
+    // significant one not sent yet
+    std::optional<VkHdrMetadataEXT> metadata;
+    std::optional<VkHdrMetadataEXT> pendingDescriptionMetadata;
+    std::optional<VkHdrMetadataEXT> pendingMetadata;
+    std::chrono::steady_clock::time_point lastMetadataChange;
+    MetadataStats metadataStats;
+
+    uint32_t managerGeneration;
+    uint64_t capsSerial;
+    // Whether the colorspace was supported and optimal at the last check,
+    // the swapchain is suboptimal from a transition away from that until
+    // one back to it.
+    bool optimal;
+    bool suboptimal;
   };
   VKROOTS_DEFINE_SYNCHRONIZED_MAP_TYPE(HdrSwapchain, VkSwapchainKHR);
 
-  enum DescStatus
+  static constexpr struct wp_image_description_v1_listener image_description_interface_listener
   {
-    WAITING,
-    READY,
-    FAILED,
+    .failed = [](
+                  void *data,
+                  struct wp_image_description_v1 *wp_image_description_v1,
+                  uint32_t cause,
+                  const char *msg)
+    {
+      fprintf(stderr, "[HDR Layer] Image description failed: Cause %u, message: %s.\n", cause, msg);
+      auto state = reinterpret_cast<enum DescStatus *>(data);
+      *state = DescStatus::FAILED;
+    },
+    .ready = [](void *data, struct wp_image_description_v1 *wp_image_description_v1, uint32_t identity)
+    {
+      auto state = reinterpret_cast<enum DescStatus *>(data);
+      *state = DescStatus::READY;
+    }
+    // we don't call get_information, so the rest should never be called
+  };
+
+  struct HdrInstanceData
+  {
+    // VK_HDRWSI_sdr_overlay was enabled by the application
+    bool sdrOverlay;
   };
+  VKROOTS_DEFINE_SYNCHRONIZED_MAP_TYPE(HdrInstance, VkInstance);
+
+  struct HdrOverlaySurfaceData
+  {
+    wl_display *display;
+    wl_event_queue *queue;
+    wl_compositor *compositor;
+    wl_subcompositor *subcompositor;
+    wp_color_manager_v1 *colorManagement;
+
+    std::vector<uint32_t> features;
+    std::vector<uint32_t> tf_cicp;
+    std::vector<uint32_t> primaries_cicp;
+
+    wl_surface *surface;
+    wl_subsurface *subsurface;
+    wp_color_management_surface_v1 *colorSurface;
+    wp_image_description_v1 *colorDescription;
+  };
+  VKROOTS_DEFINE_SYNCHRONIZED_MAP_TYPE(HdrOverlaySurface, VkSurfaceKHR);
+
+  // vkroots' chain helpers only cover Khronos structures, so the chain is
+  // walked here. It belongs to the application and is only ever read.
+  static const VkWaylandSdrOverlaySurfaceCreateInfoHDRWSI *find_overlay_info(const VkWaylandSurfaceCreateInfoKHR *pCreateInfo)
+  {
+    for (auto next = reinterpret_cast<const VkBaseInStructure *>(pCreateInfo->pNext); next; next = next->pNext)
+    {
+      if (next->sType == VK_STRUCTURE_TYPE_WAYLAND_SDR_OVERLAY_SURFACE_CREATE_INFO_HDRWSI)
+        return reinterpret_cast<const VkWaylandSdrOverlaySurfaceCreateInfoHDRWSI *>(next);
+    }
+    return nullptr;
+  }
 
   class VkInstanceOverrides
   {
@@ -195,14 +630,30 @@ namespace HdrLayer
           pCreateInfo->ppEnabledExtensionNames,
           pCreateInfo->ppEnabledExtensionNames + pCreateInfo->enabledExtensionCount);
 
-      if (contains_str(enabledExts, VK_EXT_SWAPCHAIN_COLOR_SPACE_EXTENSION_NAME))
-        std::erase(enabledExts, VK_EXT_SWAPCHAIN_COLOR_SPACE_EXTENSION_NAME);
+      // Both are implemented by the layer alone, the driver can't know them
+      std::erase_if(enabledExts, [](const char *name)
+                    { return name == std::string_view(VK_EXT_SWAPCHAIN_COLOR_SPACE_EXTENSION_NAME); });
+      bool sdrOverlay = contains_str(enabledExts, VK_HDRWSI_SDR_OVERLAY_EXTENSION_NAME);
+      std::erase_if(enabledExts, [](const char *name)
+                    { return name == std::string_view(VK_HDRWSI_SDR_OVERLAY_EXTENSION_NAME); });
 
       VkInstanceCreateInfo createInfo = *pCreateInfo;
       createInfo.enabledExtensionCount = uint32_t(enabledExts.size());
       createInfo.ppEnabledExtensionNames = enabledExts.data();
 
-      return pfnCreateInstanceProc(&createInfo, pAllocator, pInstance);
+      VkResult res = pfnCreateInstanceProc(&createInfo, pAllocator, pInstance);
+      if (res == VK_SUCCESS)
+        HdrInstance::create(*pInstance, HdrInstanceData{.sdrOverlay = sdrOverlay});
+      return res;
+    }
+
+    static void DestroyInstance(
+        const vkroots::VkInstanceDispatch *pDispatch,
+        VkInstance instance,
+        const VkAllocationCallbacks *pAllocator)
+    {
+      HdrInstance::remove(instance);
+      pDispatch->DestroyInstance(instance, pAllocator);
     }
 
     static VkResult CreateWaylandSurfaceKHR(
@@ -212,73 +663,111 @@ namespace HdrLayer
         const VkAllocationCallbacks *pAllocator,
         VkSurfaceKHR *pSurface)
     {
+      // Drivers skip extending structures they don't know, so the overlay
+      // struct is passed down as is. It is only left out of our own copy when
+      // it comes first.
+      VkWaylandSurfaceCreateInfoKHR createInfo = *pCreateInfo;
+      auto pOverlayInfo = find_overlay_info(pCreateInfo);
+      if (pOverlayInfo && createInfo.pNext == pOverlayInfo)
+        createInfo.pNext = pOverlayInfo->pNext;
+
+      if (pOverlayInfo)
+      {
+        bool enabled = false;
+        if (auto hdrInstance = HdrInstance::get(instance))
+          enabled = hdrInstance->sdrOverlay;
+        if (!enabled)
+          fprintf(stderr, "[HDR Layer] VkWaylandSdrOverlaySurfaceCreateInfoHDRWSI without " VK_HDRWSI_SDR_OVERLAY_EXTENSION_NAME " enabled, ignoring it\n");
+        else if (auto res = CreateOverlaySurface(pDispatch, instance, &createInfo, pOverlayInfo, pAllocator, pSurface))
+          return *res;
+      }
+
       auto queue = wl_display_create_queue(pCreateInfo->display);
-      wl_registry *registry = wl_display_get_registry(pCreateInfo->display);
-      wl_proxy_set_queue(reinterpret_cast<wl_proxy *>(registry), queue);
+      auto displayWrapper = reinterpret_cast<wl_display *>(wl_proxy_create_wrapper(pCreateInfo->display));
+      wl_proxy_set_queue(reinterpret_cast<wl_proxy *>(displayWrapper), queue);
+      wl_registry *registry = wl_display_get_registry(displayWrapper);
 
-      VkResult res = pDispatch->CreateWaylandSurfaceKHR(instance, pCreateInfo, pAllocator, pSurface);
+      VkResult res = pDispatch->CreateWaylandSurfaceKHR(instance, &createInfo, pAllocator, pSurface);
       if (res != VK_SUCCESS)
       {
+        wl_registry_destroy(registry);
+        wl_proxy_wrapper_destroy(displayWrapper);
+        wl_event_queue_destroy(queue);
         return res;
       }
+      if (auto record = trace_append(TraceType::CreateSurface, trace_handle(*pSurface), 0, res))
+        record->overlay = 0;
+
+      if (tearing_control_enabled() || configured_content_type())
+        CreateHintSurface(*pSurface, pCreateInfo);
 
       {
         auto hdrSurface = HdrSurface::create(*pSurface, HdrSurfaceData{
                                                             .instance = instance,
                                                             .display = pCreateInfo->display,
                                                             .queue = queue,
+                                                            .displayWrapper = displayWrapper,
+                                                            .registry = registry,
                                                             .colorManagement = nullptr,
                                                             .colorRepresentationMgr = nullptr,
+                                                            .colorManagementName = 0,
+                                                            .colorRepresentationName = 0,
                                                             .features = {},
                                                             .tf_cicp = {},
                                                             .primaries_cicp = {},
+                                                            .managerGeneration = 0,
+                                                            .capsSerial = 0,
+                                                            .capsSync = nullptr,
                                                             .surface = pCreateInfo->surface,
                                                             .colorSurface = nullptr,
                                                             .colorRepresentation = nullptr,
+                                                            .preferred = {},
+                                                            .pendingPreferred = {},
+                                                            .preferredDescription = nullptr,
                                                         });
 
+        // The registry is kept around to follow the color management globals
+        // going away or being re-announced (e.g. compositor restarting its color pipeline).
         wl_registry_add_listener(registry, &s_registryListener, reinterpret_cast<void *>(hdrSurface.get()));
         wl_display_dispatch_queue(pCreateInfo->display, queue);
         wl_display_roundtrip_queue(pCreateInfo->display, queue); // get globals
         wl_display_roundtrip_queue(pCreateInfo->display, queue); // get features/supported_cicps/etc
-        wl_registry_destroy(registry);
       }
 
       if (!HdrSurface::get(*pSurface)->colorManagement)
       {
         fprintf(stderr, "[HDR Layer] wayland compositor lacking color management protocol..\n");
 
-        HdrSurface::remove(*pSurface);
+        DestroySurfaceState(*pSurface);
         return VK_SUCCESS;
       }
       if (!contains_u32(HdrSurface::get(*pSurface)->features, WP_COLOR_MANAGER_V1_FEATURE_PARAMETRIC))
       {
         fprintf(stderr, "[HDR Layer] color management implementation doesn't support parametric image descriptions..\n");
-        HdrSurface::remove(*pSurface);
+        DestroySurfaceState(*pSurface);
         return VK_SUCCESS;
       }
       if (!contains_u32(HdrSurface::get(*pSurface)->features, WP_COLOR_MANAGER_V1_FEATURE_SET_PRIMARIES))
       {
         fprintf(stderr, "[HDR Layer] color management implementation doesn't support SET_PRIMARIES..\n");
-        HdrSurface::remove(*pSurface);
+        DestroySurfaceState(*pSurface);
         return VK_SUCCESS;
       }
       if (!HdrSurface::get(*pSurface)->colorRepresentationMgr)
       {
         fprintf(stderr, "[HDR Layer] wayland compositor lacking color representation protocol..\n");
-        HdrSurface::remove(*pSurface);
+        DestroySurfaceState(*pSurface);
         return VK_SUCCESS;
       }
 
       auto hdrSurface = HdrSurface::get(*pSurface);
 
-      wp_color_management_surface_v1 *colorSurface = wp_color_manager_v1_get_color_management_surface(hdrSurface->colorManagement, pCreateInfo->surface);
-      wp_color_management_surface_v1_add_listener(colorSurface, &color_surface_interface_listener, nullptr);
-      wp_color_representation_v1 *colorRepresentation = wp_color_representation_manager_v1_create(hdrSurface->colorRepresentationMgr, pCreateInfo->surface);
-      wl_display_flush(hdrSurface->display);
-
-      hdrSurface->colorSurface = colorSurface;
-      hdrSurface->colorRepresentation = colorRepresentation;
+      CreateColorSurface(hdrSurface.get());
+      hdrSurface->colorRepresentation = wp_color_representation_manager_v1_create(hdrSurface->colorRepresentationMgr, pCreateInfo->surface);
+      while (hdrSurface->preferredDescription && wl_display_roundtrip_queue(hdrSurface->display, hdrSurface->queue) >= 0)
+      {
+        // wait for the initial preferred description
+      }
 
       fprintf(stderr, "[HDR Layer] Created HDR surface\n");
       return VK_SUCCESS;
@@ -291,8 +780,7 @@ namespace HdrLayer
         uint32_t *pSurfaceFormatCount,
         VkSurfaceFormatKHR *pSurfaceFormats)
     {
-      auto hdrSurface = HdrSurface::get(surface);
-      if (!hdrSurface)
+      if (!HdrSurface::get(surface))
         return pDispatch->GetPhysicalDeviceSurfaceFormatsKHR(physicalDevice, surface, pSurfaceFormatCount, pSurfaceFormats);
 
       uint32_t count = 0;
@@ -315,14 +803,19 @@ namespace HdrLayer
       }
       free(formats);
 
+      dispatch_surface_events(surface);
+
       std::vector<VkSurfaceFormatKHR> extraFormats = {};
-      for (auto desc = s_ExtraHDRSurfaceFormats.begin(); desc != s_ExtraHDRSurfaceFormats.end(); ++desc)
+      if (auto hdrSurface = HdrSurface::get(surface))
       {
-        // fprintf(stderr, "[HDR Layer] Testing format: %u colorspace: %u\n", desc->surface.surfaceFormat.format, desc->surface.surfaceFormat.colorSpace);
-        if (contains_u32(hdrSurface->tf_cicp, desc->tf_cicp) && contains_u32(hdrSurface->primaries_cicp, desc->primaries_cicp) && (!desc->extended_volume || contains_u32(hdrSurface->features, WP_COLOR_MANAGER_V1_FEATURE_EXTENDED_TARGET_VOLUME)) && std::find(pixelFormats.begin(), pixelFormats.end(), desc->surface.surfaceFormat.format) != pixelFormats.end())
+        for (auto desc = s_ExtraHDRSurfaceFormats.begin(); desc != s_ExtraHDRSurfaceFormats.end(); ++desc)
         {
-          fprintf(stderr, "[HDR Layer] Enabling format: %u colorspace: %u\n", desc->surface.surfaceFormat.format, desc->surface.surfaceFormat.colorSpace);
-          extraFormats.push_back(desc->surface.surfaceFormat);
+          // fprintf(stderr, "[HDR Layer] Testing format: %u colorspace: %u\n", desc->surface.surfaceFormat.format, desc->surface.surfaceFormat.colorSpace);
+          if (supports_description(*hdrSurface, *desc) && std::find(pixelFormats.begin(), pixelFormats.end(), desc->surface.surfaceFormat.format) != pixelFormats.end())
+          {
+            fprintf(stderr, "[HDR Layer] Enabling format: %u colorspace: %u\n", desc->surface.surfaceFormat.format, desc->surface.surfaceFormat.colorSpace);
+            extraFormats.push_back(desc->surface.surfaceFormat);
+          }
         }
       }
       /*
@@ -359,33 +852,43 @@ namespace HdrLayer
         uint32_t *pSurfaceFormatCount,
         VkSurfaceFormat2KHR *pSurfaceFormats)
     {
-      auto hdrSurface = HdrSurface::get(pSurfaceInfo->surface);
-      if (!hdrSurface)
+      if (!HdrSurface::get(pSurfaceInfo->surface))
         return pDispatch->GetPhysicalDeviceSurfaceFormats2KHR(physicalDevice, pSurfaceInfo, pSurfaceFormatCount, pSurfaceFormats);
 
-      uint32_t *count = nullptr;
-      VkSurfaceFormatKHR *formats = nullptr;
+      uint32_t count = 0;
       std::vector<VkFormat> pixelFormats = {};
-      auto result = pDispatch->GetPhysicalDeviceSurfaceFormatsKHR(physicalDevice, pSurfaceInfo->surface, count, formats);
+      auto result = pDispatch->GetPhysicalDeviceSurfaceFormatsKHR(physicalDevice, pSurfaceInfo->surface, &count, nullptr);
       if (result != VK_SUCCESS)
       {
         return result;
       }
-      for (uint32_t i = 0; i < *count; i++)
+      VkSurfaceFormatKHR *formats = reinterpret_cast<VkSurfaceFormatKHR *>(malloc(sizeof(VkSurfaceFormatKHR) * count));
+      result = pDispatch->GetPhysicalDeviceSurfaceFormatsKHR(physicalDevice, pSurfaceInfo->surface, &count, formats);
+      if (result != VK_SUCCESS)
+      {
+        free(formats);
+        return result;
+      }
+
+      for (uint32_t i = 0; i < count; i++)
       {
         pixelFormats.push_back(formats[i].format);
       }
       free(formats);
 
+      dispatch_surface_events(pSurfaceInfo->surface);
+
       std::vector<VkSurfaceFormat2KHR> extraFormats = {};
-      for (auto desc = s_ExtraHDRSurfaceFormats.begin(); desc != s_ExtraHDRSurfaceFormats.end(); ++desc)
+      if (auto hdrSurface = HdrSurface::get(pSurfaceInfo->surface))
       {
-        // fprintf(stderr, "[HDR Layer] Testing format: %u colorspace: %u\n", desc->surface.surfaceFormat.format, desc->surface.surfaceFormat.colorSpace);
-        if (
-            contains_u32(hdrSurface->tf_cicp, desc->tf_cicp) && contains_u32(hdrSurface->primaries_cicp, desc->primaries_cicp) && (!desc->extended_volume || contains_u32(hdrSurface->features, WP_COLOR_MANAGER_V1_FEATURE_EXTENDED_TARGET_VOLUME)) && std::find(pixelFormats.begin(), pixelFormats.end(), desc->surface.surfaceFormat.format) != pixelFormats.end())
+        for (auto desc = s_ExtraHDRSurfaceFormats.begin(); desc != s_ExtraHDRSurfaceFormats.end(); ++desc)
         {
-          fprintf(stderr, "[HDR Layer] Enabling format: %u colorspace: %u\n", desc->surface.surfaceFormat.format, desc->surface.surfaceFormat.colorSpace);
-          extraFormats.push_back(desc->surface);
+          // fprintf(stderr, "[HDR Layer] Testing format: %u colorspace: %u\n", desc->surface.surfaceFormat.format, desc->surface.surfaceFormat.colorSpace);
+          if (supports_description(*hdrSurface, *desc) && std::find(pixelFormats.begin(), pixelFormats.end(), desc->surface.surfaceFormat.format) != pixelFormats.end())
+          {
+            fprintf(stderr, "[HDR Layer] Enabling format: %u colorspace: %u\n", desc->surface.surfaceFormat.format, desc->surface.surfaceFormat.colorSpace);
+            extraFormats.push_back(desc->surface);
+          }
         }
       }
       /*
@@ -421,16 +924,12 @@ namespace HdrLayer
         VkSurfaceKHR surface,
         const VkAllocationCallbacks *pAllocator)
     {
-      if (auto state = HdrSurface::get(surface))
-      {
-        wp_color_management_surface_v1_destroy(state->colorSurface);
-        wp_color_representation_v1_destroy(state->colorRepresentation);
-        wp_color_manager_v1_destroy(state->colorManagement);
-        wp_color_representation_manager_v1_destroy(state->colorRepresentationMgr);
-        wl_event_queue_destroy(state->queue);
-      }
-      HdrSurface::remove(surface);
+      trace_append(TraceType::DestroySurface, trace_handle(surface), 0, VK_SUCCESS);
+      DestroySurfaceState(surface);
+      DestroyHintSurfaceState(surface);
       pDispatch->DestroySurfaceKHR(instance, surface, pAllocator);
+      // the overlay's wl_surface has to outlive the driver's surface
+      DestroyOverlaySurfaceState(surface);
     }
 
     static VkResult
@@ -468,6 +967,235 @@ namespace HdrLayer
     }
 
   private:
+    // Nothing if the compositor can't do subsurfaces, the surface is then
+    // created on the parent like without the overlay struct.
+    static std::optional<VkResult> CreateOverlaySurface(
+        const vkroots::VkInstanceDispatch *pDispatch,
+        VkInstance instance,
+        const VkWaylandSurfaceCreateInfoKHR *pCreateInfo,
+        const VkWaylandSdrOverlaySurfaceCreateInfoHDRWSI *pOverlayInfo,
+        const VkAllocationCallbacks *pAllocator,
+        VkSurfaceKHR *pSurface)
+    {
+      HdrOverlaySurfaceData overlay = {
+          .display = pCreateInfo->display,
+          .queue = wl_display_create_queue(pCreateInfo->display),
+          .compositor = nullptr,
+          .subcompositor = nullptr,
+          .colorManagement = nullptr,
+          .features = {},
+          .tf_cicp = {},
+          .primaries_cicp = {},
+          .surface = nullptr,
+          .subsurface = nullptr,
+          .colorSurface = nullptr,
+          .colorDescription = nullptr,
+      };
+
+      auto displayWrapper = reinterpret_cast<wl_display *>(wl_proxy_create_wrapper(pCreateInfo->display));
+      wl_proxy_set_queue(reinterpret_cast<wl_proxy *>(displayWrapper), overlay.queue);
+      wl_registry *registry = wl_display_get_registry(displayWrapper);
+      wl_proxy_wrapper_destroy(displayWrapper);
+      wl_registry_add_listener(registry, &s_overlayRegistryListener, &overlay);
+      wl_display_roundtrip_queue(overlay.display, overlay.queue); // get globals
+      wl_display_roundtrip_queue(overlay.display, overlay.queue); // get features/supported_cicps/etc
+      wl_registry_destroy(registry);
+
+      if (!overlay.compositor || !overlay.subcompositor)
+      {
+        fprintf(stderr, "[HDR Layer] wayland compositor lacking subsurfaces, creating the SDR overlay on the parent surface instead..\n");
+        DestroyOverlayObjects(overlay);
+        return std::nullopt;
+      }
+
+      overlay.surface = wl_compositor_create_surface(overlay.compositor);
+      // The driver and app never expect events for this surface on our queue
+      wl_proxy_set_queue(reinterpret_cast<wl_proxy *>(overlay.surface), nullptr);
+
+      // HUDs shouldn't steal input from the game
+      wl_region *inputRegion = wl_compositor_create_region(overlay.compositor);
+      wl_surface_set_input_region(overlay.surface, inputRegion);
+      wl_region_destroy(inputRegion);
+
+      overlay.subsurface = wl_subcompositor_get_subsurface(overlay.subcompositor, overlay.surface, pCreateInfo->surface);
+      wl_subsurface_set_position(overlay.subsurface, pOverlayInfo->x, pOverlayInfo->y);
+      wl_subsurface_place_above(overlay.subsurface, pCreateInfo->surface);
+      if (pOverlayInfo->desynchronized)
+        wl_subsurface_set_desync(overlay.subsurface);
+
+      if (overlay.colorManagement &&
+          contains_u32(overlay.features, WP_COLOR_MANAGER_V1_FEATURE_PARAMETRIC) &&
+          contains_u32(overlay.primaries_cicp, 1) && contains_u32(overlay.tf_cicp, 13))
+      {
+        // Plain sRGB, how bright SDR white ends up is the compositor's call.
+        // Mastering luminance would be the wrong field for it and is only
+        // allowed with PQ anyway.
+        wp_image_description_creator_params_v1 *params = wp_color_manager_v1_new_parametric_creator(overlay.colorManagement);
+        wp_image_description_creator_params_v1_set_primaries_cicp(params, 1);
+        wp_image_description_creator_params_v1_set_tf_cicp(params, 13);
+
+        auto status = DescStatus::WAITING;
+        overlay.colorDescription = wp_image_description_creator_params_v1_create(params);
+        wp_image_description_creator_params_v1_destroy(params);
+        wp_image_description_v1_add_listener(overlay.colorDescription, &image_description_interface_listener, &status);
+        while (status == DescStatus::WAITING)
+        {
+          wl_display_roundtrip_queue(overlay.display, overlay.queue);
+        }
+
+        if (status == DescStatus::READY)
+        {
+          overlay.colorSurface = wp_color_manager_v1_get_color_management_surface(overlay.colorManagement, overlay.surface);
+          wp_color_management_surface_v1_set_image_description(overlay.colorSurface, overlay.colorDescription, WP_COLOR_MANAGER_V1_RENDER_INTENT_PERCEPTUAL);
+        }
+        else
+        {
+          fprintf(stderr, "[HDR Layer] Failed to create SDR overlay image description, leaving it untagged\n");
+        }
+      }
+
+      // Objects created from the globals stay valid, nothing else is needed from them.
+      if (overlay.colorManagement)
+        wp_color_manager_v1_destroy(overlay.colorManagement);
+      wl_subcompositor_destroy(overlay.subcompositor);
+      wl_compositor_destroy(overlay.compositor);
+      overlay.colorManagement = nullptr;
+      overlay.subcompositor = nullptr;
+      overlay.compositor = nullptr;
+      wl_display_flush(overlay.display);
+
+      VkWaylandSurfaceCreateInfoKHR createInfo = *pCreateInfo;
+      createInfo.surface = overlay.surface;
+
+      VkResult res = pDispatch->CreateWaylandSurfaceKHR(instance, &createInfo, pAllocator, pSurface);
+      if (res != VK_SUCCESS)
+      {
+        DestroyOverlayObjects(overlay);
+        return res;
+      }
+
+      fprintf(stderr, "[HDR Layer] Created SDR overlay surface id: %u for id: %u\n",
+              wl_proxy_get_id(reinterpret_cast<struct wl_proxy *>(overlay.surface)),
+              wl_proxy_get_id(reinterpret_cast<struct wl_proxy *>(pCreateInfo->surface)));
+
+      HdrOverlaySurface::create(*pSurface, std::move(overlay));
+      if (auto record = trace_append(TraceType::CreateSurface, trace_handle(*pSurface), 0, res))
+        record->overlay = 1;
+      return VK_SUCCESS;
+    }
+
+    static void DestroyOverlayObjects(HdrOverlaySurfaceData &overlay)
+    {
+      if (overlay.colorDescription)
+        wp_image_description_v1_destroy(overlay.colorDescription);
+      if (overlay.colorSurface)
+        wp_color_management_surface_v1_destroy(overlay.colorSurface);
+      if (overlay.subsurface)
+        wl_subsurface_destroy(overlay.subsurface);
+      if (overlay.surface)
+        wl_surface_destroy(overlay.surface);
+      if (overlay.colorManagement)
+        wp_color_manager_v1_destroy(overlay.colorManagement);
+      if (overlay.subcompositor)
+        wl_subcompositor_destroy(overlay.subcompositor);
+      if (overlay.compositor)
+        wl_compositor_destroy(overlay.compositor);
+      wl_display_flush(overlay.display);
+      wl_event_queue_destroy(overlay.queue);
+    }
+
+    static void DestroyOverlaySurfaceState(VkSurfaceKHR surface)
+    {
+      if (auto state = HdrOverlaySurface::get(surface))
+        DestroyOverlayObjects(*state);
+      HdrOverlaySurface::remove(surface);
+    }
+
+    static void DestroySurfaceState(VkSurfaceKHR surface)
+    {
+      if (auto state = HdrSurface::get(surface))
+      {
+        if (state->preferredDescription)
+          wp_image_description_v1_destroy(state->preferredDescription);
+        if (state->colorSurface)
+          wp_color_management_surface_v1_destroy(state->colorSurface);
+        if (state->colorRepresentation)
+          wp_color_representation_v1_destroy(state->colorRepresentation);
+        if (state->colorManagement)
+          wp_color_manager_v1_destroy(state->colorManagement);
+        if (state->colorRepresentationMgr)
+          wp_color_representation_manager_v1_destroy(state->colorRepresentationMgr);
+        if (state->capsSync)
+          wl_callback_destroy(state->capsSync);
+        wl_registry_destroy(state->registry);
+        wl_proxy_wrapper_destroy(state->displayWrapper);
+        wl_event_queue_destroy(state->queue);
+      }
+      HdrSurface::remove(surface);
+    }
+
+    static void CreateHintSurface(VkSurfaceKHR vkSurface, const VkWaylandSurfaceCreateInfoKHR *pCreateInfo)
+    {
+      auto queue = wl_display_create_queue(pCreateInfo->display);
+      auto displayWrapper = reinterpret_cast<wl_display *>(wl_proxy_create_wrapper(pCreateInfo->display));
+      wl_proxy_set_queue(reinterpret_cast<wl_proxy *>(displayWrapper), queue);
+      wl_registry *registry = wl_display_get_registry(displayWrapper);
+      wl_proxy_wrapper_destroy(displayWrapper);
+
+      auto hints = HintSurface::create(vkSurface, HintSurfaceData{
+                                                      .display = pCreateInfo->display,
+                                                      .queue = queue,
+                                                      .registry = registry,
+                                                      .tearingControlMgr = nullptr,
+                                                      .contentTypeMgr = nullptr,
+                                                      .tearingControlName = 0,
+                                                      .contentTypeName = 0,
+                                                      .surface = pCreateInfo->surface,
+                                                      .tearingControl = nullptr,
+                                                      .contentType = nullptr,
+                                                  });
+
+      // Kept around to follow the globals going away
+      wl_registry_add_listener(registry, &s_hintRegistryListener, reinterpret_cast<void *>(hints.get()));
+      wl_display_roundtrip_queue(pCreateInfo->display, queue);
+    }
+
+    static void DestroyHintSurfaceState(VkSurfaceKHR surface)
+    {
+      if (auto state = HintSurface::get(surface))
+      {
+        if (state->tearingControl)
+          wp_tearing_control_v1_destroy(state->tearingControl);
+        if (state->contentType)
+          wp_content_type_v1_destroy(state->contentType);
+        if (state->tearingControlMgr)
+          wp_tearing_control_manager_v1_destroy(state->tearingControlMgr);
+        if (state->contentTypeMgr)
+          wp_content_type_manager_v1_destroy(state->contentTypeMgr);
+        wl_registry_destroy(state->registry);
+        wl_event_queue_destroy(state->queue);
+      }
+      HintSurface::remove(surface);
+    }
+
+    static void CreateColorSurface(HdrSurfaceData *surface)
+    {
+      surface->colorSurface = wp_color_manager_v1_get_color_management_surface(surface->colorManagement, surface->surface);
+      wp_color_management_surface_v1_add_listener(surface->colorSurface, &color_surface_interface_listener, surface);
+      RequestPreferred(surface);
+      wl_display_flush(surface->display);
+    }
+
+    static void RequestPreferred(HdrSurfaceData *surface)
+    {
+      if (surface->preferredDescription)
+        wp_image_description_v1_destroy(surface->preferredDescription);
+
+      surface->pendingPreferred = {};
+      surface->preferredDescription = wp_color_management_surface_v1_get_preferred(surface->colorSurface);
+      wp_image_description_v1_add_listener(surface->preferredDescription, &preferred_description_interface_listener, surface);
+    }
+
     static constexpr struct wp_color_manager_v1_listener color_interface_listener
     {
       .supported_intent = [](void *data,
@@ -479,16 +1207,43 @@ namespace HdrLayer
       {
         auto surface = reinterpret_cast<HdrSurfaceData *>(data);
         surface->features.push_back(feature);
+        surface->capsSerial++;
       },
       .supported_tf_cicp = [](void *data, struct wp_color_manager_v1 *wp_color_manager_v1, uint32_t tf_code)
       {
         auto surface = reinterpret_cast<HdrSurfaceData *>(data);
         surface->tf_cicp.push_back(tf_code);
+        surface->capsSerial++;
       },
       .supported_primaries_cicp = [](void *data, struct wp_color_manager_v1 *wp_color_manager_v1, uint32_t primaries_code)
       {
         auto surface = reinterpret_cast<HdrSurfaceData *>(data);
         surface->primaries_cicp.push_back(primaries_code);
+        surface->capsSerial++;
+      }
+    };
+
+    static constexpr struct wp_color_manager_v1_listener overlay_color_interface_listener
+    {
+      .supported_intent = [](void *data,
+                             struct wp_color_manager_v1 *wp_color_manager_v1,
+                             uint32_t render_intent) {},
+      .supported_feature = [](void *data,
+                              struct wp_color_manager_v1 *wp_color_manager_v1,
+                              uint32_t feature)
+      {
+        auto overlay = reinterpret_cast<HdrOverlaySurfaceData *>(data);
+        overlay->features.push_back(feature);
+      },
+      .supported_tf_cicp = [](void *data, struct wp_color_manager_v1 *wp_color_manager_v1, uint32_t tf_code)
+      {
+        auto overlay = reinterpret_cast<HdrOverlaySurfaceData *>(data);
+        overlay->tf_cicp.push_back(tf_code);
+      },
+      .supported_primaries_cicp = [](void *data, struct wp_color_manager_v1 *wp_color_manager_v1, uint32_t primaries_code)
+      {
+        auto overlay = reinterpret_cast<HdrOverlaySurfaceData *>(data);
+        overlay->primaries_cicp.push_back(primaries_code);
       }
     };
 
@@ -505,7 +1260,71 @@ namespace HdrLayer
     static constexpr struct wp_color_management_surface_v1_listener color_surface_interface_listener
     {
       .preferred_changed = [](void *data,
-                              struct wp_color_management_surface_v1 *wp_color_management_surface_v1) {}
+                              struct wp_color_management_surface_v1 *wp_color_management_surface_v1)
+      {
+        auto surface = reinterpret_cast<HdrSurfaceData *>(data);
+        RequestPreferred(surface);
+      }
+    };
+
+    static constexpr struct wp_image_description_v1_listener preferred_description_interface_listener
+    {
+      .failed = [](void *data, struct wp_image_description_v1 *wp_image_description_v1, uint32_t cause, const char *msg)
+      {
+        fprintf(stderr, "[HDR Layer] Preferred image description unavailable: Cause %u, message: %s.\n", cause, msg);
+        auto surface = reinterpret_cast<HdrSurfaceData *>(data);
+        wp_image_description_v1_destroy(surface->preferredDescription);
+        surface->preferredDescription = nullptr;
+      },
+      .ready = [](void *data, struct wp_image_description_v1 *wp_image_description_v1, uint32_t identity)
+      {
+        wp_image_description_v1_get_information(wp_image_description_v1);
+      },
+      .done = [](void *data, struct wp_image_description_v1 *wp_image_description_v1)
+      {
+        auto surface = reinterpret_cast<HdrSurfaceData *>(data);
+        if (surface->preferred.primaries_cicp != surface->pendingPreferred.primaries_cicp || surface->preferred.tf_cicp != surface->pendingPreferred.tf_cicp)
+        {
+          fprintf(stderr, "[HDR Layer] Preferred image description changed: primaries %d, tf %d\n", surface->pendingPreferred.primaries_cicp, surface->pendingPreferred.tf_cicp);
+          surface->preferred = surface->pendingPreferred;
+          surface->capsSerial++;
+        }
+        wp_image_description_v1_destroy(surface->preferredDescription);
+        surface->preferredDescription = nullptr;
+      },
+      .icc_file = [](void *data, struct wp_image_description_v1 *wp_image_description_v1, int32_t icc, uint32_t icc_size)
+      {
+        close(icc);
+      },
+      .primaries = [](void *data, struct wp_image_description_v1 *wp_image_description_v1,
+                      uint32_t r_x, uint32_t r_y, uint32_t g_x, uint32_t g_y, uint32_t b_x, uint32_t b_y, uint32_t w_x, uint32_t w_y) {},
+      .primaries_cicp = [](void *data, struct wp_image_description_v1 *wp_image_description_v1, uint32_t primaries_code)
+      {
+        auto surface = reinterpret_cast<HdrSurfaceData *>(data);
+        surface->pendingPreferred.primaries_cicp = int(primaries_code);
+      },
+      .tf_cicp = [](void *data, struct wp_image_description_v1 *wp_image_description_v1, uint32_t tf_code)
+      {
+        auto surface = reinterpret_cast<HdrSurfaceData *>(data);
+        surface->pendingPreferred.tf_cicp = int(tf_code);
+      },
+      .tf_power = [](void *data, struct wp_image_description_v1 *wp_image_description_v1, uint32_t eexp) {},
+      .target_primaries = [](void *data, struct wp_image_description_v1 *wp_image_description_v1,
+                             uint32_t r_x, uint32_t r_y, uint32_t g_x, uint32_t g_y, uint32_t b_x, uint32_t b_y, uint32_t w_x, uint32_t w_y) {},
+      .target_luminance = [](void *data, struct wp_image_description_v1 *wp_image_description_v1, uint32_t min_lum, uint32_t max_lum) {},
+      .target_max_cll = [](void *data, struct wp_image_description_v1 *wp_image_description_v1, uint32_t max_cll) {},
+      .target_max_fall = [](void *data, struct wp_image_description_v1 *wp_image_description_v1, uint32_t max_fall) {},
+    };
+
+    static constexpr wl_callback_listener caps_sync_listener
+    {
+      .done = [](void *data, wl_callback *callback, uint32_t callback_data)
+      {
+        auto surface = reinterpret_cast<HdrSurfaceData *>(data);
+        wl_callback_destroy(surface->capsSync);
+        surface->capsSync = nullptr;
+        surface->capsSerial++;
+      }
     };
 
     static constexpr wl_registry_listener s_registryListener = {
@@ -514,13 +1333,124 @@ namespace HdrLayer
         auto surface = reinterpret_cast<HdrSurfaceData *>(data);
 
         if (interface == "wp_color_manager_v1"sv) {
+          // A re-announced global means the compositor restarted its color pipeline,
+          // everything learned from the previous instance is stale.
+          bool rebind = surface->managerGeneration != 0;
+          surface->features.clear();
+          surface->tf_cicp.clear();
+          surface->primaries_cicp.clear();
+          surface->managerGeneration++;
+          surface->capsSerial++;
+
+          surface->colorManagementName = name;
           surface->colorManagement = reinterpret_cast<wp_color_manager_v1 *>(
             wl_registry_bind(registry, name, &wp_color_manager_v1_interface, version));
           wp_color_manager_v1_add_listener(surface->colorManagement, &color_interface_listener, data);
+
+          // The capabilities follow the bind, swapchains wait for all of them before re-evaluating.
+          if (surface->capsSync)
+            wl_callback_destroy(surface->capsSync);
+          surface->capsSync = wl_display_sync(surface->displayWrapper);
+          wl_callback_add_listener(surface->capsSync, &caps_sync_listener, data);
+
+          if (rebind && !surface->colorSurface) {
+            fprintf(stderr, "[HDR Layer] Color management global re-announced, rebinding surface\n");
+            CreateColorSurface(surface);
+          }
         } else if (interface == "wp_color_representation_manager_v1"sv) {
+          surface->colorRepresentationName = name;
           surface->colorRepresentationMgr = reinterpret_cast<wp_color_representation_manager_v1 *>(
             wl_registry_bind(registry, name, &wp_color_representation_manager_v1_interface, version));
           wp_color_representation_manager_v1_add_listener(surface->colorRepresentationMgr, &representation_interface_listener, nullptr);
+
+          if (surface->colorSurface && !surface->colorRepresentation)
+            surface->colorRepresentation = wp_color_representation_manager_v1_create(surface->colorRepresentationMgr, surface->surface);
+        } },
+        .global_remove = [](void *data, wl_registry *registry, uint32_t name)
+        {
+        auto surface = reinterpret_cast<HdrSurfaceData *>(data);
+
+        if (surface->colorManagement && name == surface->colorManagementName) {
+          fprintf(stderr, "[HDR Layer] Color management global removed\n");
+          if (surface->preferredDescription)
+            wp_image_description_v1_destroy(surface->preferredDescription);
+          if (surface->colorSurface)
+            wp_color_management_surface_v1_destroy(surface->colorSurface);
+          if (surface->capsSync)
+            wl_callback_destroy(surface->capsSync);
+          wp_color_manager_v1_destroy(surface->colorManagement);
+          surface->preferredDescription = nullptr;
+          surface->colorSurface = nullptr;
+          surface->capsSync = nullptr;
+          surface->colorManagement = nullptr;
+          surface->colorManagementName = 0;
+          surface->features.clear();
+          surface->tf_cicp.clear();
+          surface->primaries_cicp.clear();
+          surface->preferred = {};
+          surface->managerGeneration++;
+          surface->capsSerial++;
+        } else if (surface->colorRepresentationMgr && name == surface->colorRepresentationName) {
+          fprintf(stderr, "[HDR Layer] Color representation global removed\n");
+          if (surface->colorRepresentation)
+            wp_color_representation_v1_destroy(surface->colorRepresentation);
+          wp_color_representation_manager_v1_destroy(surface->colorRepresentationMgr);
+          surface->colorRepresentation = nullptr;
+          surface->colorRepresentationMgr = nullptr;
+          surface->colorRepresentationName = 0;
+        } },
+    };
+
+    static constexpr wl_registry_listener s_hintRegistryListener = {
+        .global = [](void *data, wl_registry *registry, uint32_t name, const char *interface, uint32_t version)
+        {
+        auto hints = reinterpret_cast<HintSurfaceData *>(data);
+
+        if (interface == "wp_tearing_control_manager_v1"sv && tearing_control_enabled()) {
+          hints->tearingControlName = name;
+          hints->tearingControlMgr = reinterpret_cast<wp_tearing_control_manager_v1 *>(
+            wl_registry_bind(registry, name, &wp_tearing_control_manager_v1_interface, 1));
+        } else if (interface == "wp_content_type_manager_v1"sv && configured_content_type()) {
+          hints->contentTypeName = name;
+          hints->contentTypeMgr = reinterpret_cast<wp_content_type_manager_v1 *>(
+            wl_registry_bind(registry, name, &wp_content_type_manager_v1_interface, 1));
+        } },
+        .global_remove = [](void *data, wl_registry *registry, uint32_t name)
+        {
+        auto hints = reinterpret_cast<HintSurfaceData *>(data);
+
+        if (hints->tearingControlMgr && name == hints->tearingControlName) {
+          if (hints->tearingControl)
+            wp_tearing_control_v1_destroy(hints->tearingControl);
+          wp_tearing_control_manager_v1_destroy(hints->tearingControlMgr);
+          hints->tearingControl = nullptr;
+          hints->tearingControlMgr = nullptr;
+          hints->tearingControlName = 0;
+        } else if (hints->contentTypeMgr && name == hints->contentTypeName) {
+          if (hints->contentType)
+            wp_content_type_v1_destroy(hints->contentType);
+          wp_content_type_manager_v1_destroy(hints->contentTypeMgr);
+          hints->contentType = nullptr;
+          hints->contentTypeMgr = nullptr;
+          hints->contentTypeName = 0;
+        } },
+    };
+
+    static constexpr wl_registry_listener s_overlayRegistryListener = {
+        .global = [](void *data, wl_registry *registry, uint32_t name, const char *interface, uint32_t version)
+        {
+        auto overlay = reinterpret_cast<HdrOverlaySurfaceData *>(data);
+
+        if (interface == "wl_compositor"sv) {
+          overlay->compositor = reinterpret_cast<wl_compositor *>(
+            wl_registry_bind(registry, name, &wl_compositor_interface, std::min(version, 4u)));
+        } else if (interface == "wl_subcompositor"sv) {
+          overlay->subcompositor = reinterpret_cast<wl_subcompositor *>(
+            wl_registry_bind(registry, name, &wl_subcompositor_interface, 1));
+        } else if (interface == "wp_color_manager_v1"sv) {
+          overlay->colorManagement = reinterpret_cast<wp_color_manager_v1 *>(
+            wl_registry_bind(registry, name, &wp_color_manager_v1_interface, version));
+          wp_color_manager_v1_add_listener(overlay->colorManagement, &overlay_color_interface_listener, data);
         } },
         .global_remove = [](void *data, wl_registry *registry, uint32_t name) {},
     };
@@ -535,6 +1465,21 @@ namespace HdrLayer
         VkSwapchainKHR swapchain,
         const VkAllocationCallbacks *pAllocator)
     {
+      if (auto state = HdrSwapchain::get(swapchain))
+      {
+        if (state->colorDescription)
+          wp_image_description_v1_destroy(state->colorDescription);
+        if (state->pendingDescription)
+          wp_image_description_v1_destroy(state->pendingDescription);
+
+        const MetadataStats &stats = state->metadataStats;
+        if (stats.received)
+        {
+          fprintf(stderr, "[HDR Layer] HDR metadata updates: %" PRIu64 " received, %" PRIu64 " applied, %" PRIu64 " dropped, %" PRIu64 " merged\n",
+                  stats.received, stats.applied, stats.dropped, stats.merged);
+        }
+      }
+      trace_append(TraceType::DestroySwapchain, trace_handle(swapchain), 0, VK_SUCCESS);
       HdrSwapchain::remove(swapchain);
       pDispatch->DestroySwapchainKHR(device, swapchain, pAllocator);
     }
@@ -548,7 +1493,17 @@ namespace HdrLayer
     {
       auto hdrSurface = HdrSurface::get(pCreateInfo->surface);
       if (!hdrSurface)
-        return pDispatch->CreateSwapchainKHR(device, pCreateInfo, pAllocator, pSwapchain);
+      {
+        VkResult result = pDispatch->CreateSwapchainKHR(device, pCreateInfo, pAllocator, pSwapchain);
+        if (result != VK_SUCCESS)
+        {
+          trace_swapchain(pCreateInfo, result);
+          return result;
+        }
+        trace_swapchain(pCreateInfo, result, *pSwapchain);
+        SetPresentHints(pCreateInfo->surface, pCreateInfo->presentMode);
+        return result;
+      }
 
       VkSwapchainCreateInfoKHR swapchainInfo = *pCreateInfo;
 
@@ -587,32 +1542,38 @@ namespace HdrLayer
                   vkroots::helpers::enumString(pCreateInfo->imageFormat),
                   vkroots::helpers::enumString(pCreateInfo->imageColorSpace));
 
+          trace_swapchain(pCreateInfo, VK_ERROR_INITIALIZATION_FAILED);
           return VK_ERROR_INITIALIZATION_FAILED;
         }
       }
 
       VkResult result = pDispatch->CreateSwapchainKHR(device, &swapchainInfo, pAllocator, pSwapchain);
+      if (result != VK_SUCCESS)
+        trace_swapchain(pCreateInfo, result);
       if (hdrSurface && result == VK_SUCCESS)
       {
-        if (pCreateInfo->compositeAlpha == VK_COMPOSITE_ALPHA_PRE_MULTIPLIED_BIT_KHR)
-        {
-          wp_color_representation_v1_set_alpha_mode(hdrSurface->colorRepresentation, WP_COLOR_REPRESENTATION_V1_ALPHA_MODE_PREMULTIPLIED_ELECTRICAL);
-        }
-        else if (pCreateInfo->compositeAlpha == VK_COMPOSITE_ALPHA_POST_MULTIPLIED_BIT_KHR)
+        if (hdrSurface->colorRepresentation)
         {
-          wp_color_representation_v1_set_alpha_mode(hdrSurface->colorRepresentation, WP_COLOR_REPRESENTATION_V1_ALPHA_MODE_STRAIGHT);
+          if (pCreateInfo->compositeAlpha == VK_COMPOSITE_ALPHA_PRE_MULTIPLIED_BIT_KHR)
+          {
+            wp_color_representation_v1_set_alpha_mode(hdrSurface->colorRepresentation, WP_COLOR_REPRESENTATION_V1_ALPHA_MODE_PREMULTIPLIED_ELECTRICAL);
+          }
+          else if (pCreateInfo->compositeAlpha == VK_COMPOSITE_ALPHA_POST_MULTIPLIED_BIT_KHR)
+          {
+            wp_color_representation_v1_set_alpha_mode(hdrSurface->colorRepresentation, WP_COLOR_REPRESENTATION_V1_ALPHA_MODE_STRAIGHT);
+          }
         }
 
+        // Like the alpha mode these are sent once per swapchain and latched
+        // by the driver's first commit, not touched on every present.
+        SetPresentHints(pCreateInfo->surface, pCreateInfo->presentMode);
+
         auto primaries = 0;
         auto tf = 0;
-        for (auto desc = s_ExtraHDRSurfaceFormats.begin(); desc != s_ExtraHDRSurfaceFormats.end(); ++desc)
+        if (auto desc = find_description(pCreateInfo->imageColorSpace))
         {
-          if (desc->surface.surfaceFormat.colorSpace == pCreateInfo->imageColorSpace)
-          {
-            primaries = desc->primaries_cicp;
-            tf = desc->tf_cicp;
-            break;
-          }
+          primaries = desc->primaries_cicp;
+          tf = desc->tf_cicp;
         }
 
         if (primaries == 0 && tf == 0 && pCreateInfo->imageColorSpace != VK_COLOR_SPACE_SRGB_NONLINEAR_KHR && pCreateInfo->imageColorSpace != VK_COLOR_SPACE_PASS_THROUGH_EXT)
@@ -628,21 +1589,14 @@ namespace HdrLayer
 
         wp_image_description_v1 *desc = nullptr;
 
-        if (primaries != 0 && tf != 0)
+        if (primaries != 0 && tf != 0 && hdrSurface->colorManagement)
         {
-          auto status = DescStatus::WAITING;
-          wp_image_description_creator_params_v1 *params = wp_color_manager_v1_new_parametric_creator(hdrSurface->colorManagement);
-          wp_image_description_creator_params_v1_set_primaries_cicp(params, primaries);
-          wp_image_description_creator_params_v1_set_tf_cicp(params, tf);
-          desc = wp_image_description_creator_params_v1_create(params);
-          wp_image_description_v1_add_listener(desc, &image_description_interface_listener, &status);
-          while (status == DescStatus::WAITING)
-          {
-            wl_display_roundtrip_queue(hdrSurface->display, hdrSurface->queue);
-          }
-          if (status == DescStatus::FAILED)
+          desc = CreateImageDescription(*hdrSurface, primaries, tf, nullptr);
+          if (!desc)
           {
             fprintf(stderr, "[HDR Layer] Failed to create image description, failing swapchain creation");
+            pDispatch->DestroySwapchainKHR(device, *pSwapchain, pAllocator);
+            trace_swapchain(pCreateInfo, VK_ERROR_INITIALIZATION_FAILED);
             return VK_ERROR_INITIALIZATION_FAILED;
           }
         }
@@ -653,11 +1607,26 @@ namespace HdrLayer
 
         HdrSwapchain::create(*pSwapchain, HdrSwapchainData{
                                               .surface = pCreateInfo->surface,
+                                              .display = hdrSurface->display,
+                                              .queue = hdrSurface->queue,
+                                              .colorSpace = pCreateInfo->imageColorSpace,
                                               .primaries = primaries,
                                               .tf = tf,
                                               .colorDescription = desc,
                                               .desc_dirty = true,
+                                              .pendingDescription = nullptr,
+                                              .pendingStatus = DescStatus::WAITING,
+                                              .metadata = std::nullopt,
+                                              .pendingDescriptionMetadata = std::nullopt,
+                                              .pendingMetadata = std::nullopt,
+                                              .lastMetadataChange = {},
+                                              .metadataStats = {},
+                                              .managerGeneration = hdrSurface->managerGeneration,
+                                              .capsSerial = hdrSurface->capsSerial,
+                                              .optimal = IsColorSpaceOptimal(*hdrSurface, pCreateInfo->imageColorSpace),
+                                              .suboptimal = false,
                                           });
+        trace_swapchain(pCreateInfo, result, *pSwapchain);
       }
       return result;
     }
@@ -672,62 +1641,62 @@ namespace HdrLayer
     {
       for (uint32_t i = 0; i < swapchainCount; i++)
       {
-        auto hdrSwapchain = HdrSwapchain::get(pSwapchains[i]);
-        if (!hdrSwapchain)
+        if (auto record = trace_append(TraceType::SetHdrMetadata, trace_handle(pSwapchains[i]), 0, VK_SUCCESS))
+        {
+          const VkHdrMetadataEXT &metadata = pMetadata[i];
+          record->metadata = TraceMetadata{
+              .displayPrimaryRed = {metadata.displayPrimaryRed.x, metadata.displayPrimaryRed.y},
+              .displayPrimaryGreen = {metadata.displayPrimaryGreen.x, metadata.displayPrimaryGreen.y},
+              .displayPrimaryBlue = {metadata.displayPrimaryBlue.x, metadata.displayPrimaryBlue.y},
+              .whitePoint = {metadata.whitePoint.x, metadata.whitePoint.y},
+              .maxLuminance = metadata.maxLuminance,
+              .minLuminance = metadata.minLuminance,
+              .maxContentLightLevel = metadata.maxContentLightLevel,
+              .maxFrameAverageLightLevel = metadata.maxFrameAverageLightLevel,
+          };
+        }
+
+        auto surface = swapchain_surface(pSwapchains[i]);
+        if (!surface)
         {
           fprintf(stderr, "[HDR Layer] SetHdrMetadataEXT: Swapchain %u does not support HDR.\n", i);
           continue;
         }
 
-        auto hdrSurface = HdrSurface::get(hdrSwapchain->surface);
+        auto hdrSurface = HdrSurface::get(*surface);
         if (!hdrSurface)
         {
           fprintf(stderr, "[HDR Layer] SetHdrMetadataEXT: Surface for swapchain %u was already destroyed. (App use after free).\n", i);
           abort();
           continue;
         }
+        auto hdrSwapchain = HdrSwapchain::get(pSwapchains[i]);
+        if (!hdrSwapchain)
+          continue;
 
         const VkHdrMetadataEXT &metadata = pMetadata[i];
-        wp_image_description_creator_params_v1 *params = wp_color_manager_v1_new_parametric_creator(hdrSurface->colorManagement);
-        wp_image_description_creator_params_v1_set_mastering_display_primaries(
-            params,
-            (uint32_t)round(metadata.displayPrimaryRed.x * 10000.0),
-            (uint32_t)round(metadata.displayPrimaryRed.y * 10000.0),
-            (uint32_t)round(metadata.displayPrimaryGreen.x * 10000.0),
-            (uint32_t)round(metadata.displayPrimaryGreen.y * 10000.0),
-            (uint32_t)round(metadata.displayPrimaryBlue.x * 10000.0),
-            (uint32_t)round(metadata.displayPrimaryBlue.y * 10000.0),
-            (uint32_t)round(metadata.whitePoint.x * 10000.0),
-            (uint32_t)round(metadata.whitePoint.y * 10000.0));
-        wp_image_description_creator_params_v1_set_mastering_luminance(
-            params,
-            (uint32_t)round(metadata.minLuminance * 10000.0),
-            (uint32_t)round(metadata.maxLuminance));
-        wp_image_description_creator_params_v1_set_primaries_cicp(params, hdrSwapchain->primaries);
-        wp_image_description_creator_params_v1_set_tf_cicp(params, hdrSwapchain->tf);
-        wp_image_description_creator_params_v1_set_max_cll(params, (uint32_t)round(metadata.maxContentLightLevel));
-        wp_image_description_creator_params_v1_set_max_fall(params, (uint32_t)round(metadata.maxFrameAverageLightLevel));
+        MetadataStats &stats = hdrSwapchain->metadataStats;
+        stats.received++;
 
-        auto status = DescStatus::WAITING;
-        wp_image_description_v1 *desc = wp_image_description_creator_params_v1_create(params);
-        wp_image_description_v1_add_listener(desc, &image_description_interface_listener, &status);
-        while (status == DescStatus::WAITING)
-        {
-          wl_display_roundtrip_queue(hdrSurface->display, hdrSurface->queue);
-        }
-        if (status == DescStatus::FAILED)
+        // Compared to what the compositor has or is about to get
+        const std::optional<VkHdrMetadataEXT> &current = hdrSwapchain->pendingDescription ? hdrSwapchain->pendingDescriptionMetadata : hdrSwapchain->metadata;
+        if (current)
         {
-          fprintf(stderr, "[HDR Layer] Failed to create new image description for new metadata!");
+          const MetadataCoalescing &config = metadata_coalescing();
+          double distance = metadata_distance(*current, metadata, config);
+          if (distance < (hdrSwapchain->pendingMetadata ? config.hysteresis : 1.0))
+          {
+            // Jitter around the applied value, also cancels a pending change that fell back into the band
+            hdrSwapchain->pendingMetadata.reset();
+            stats.dropped++;
+            continue;
+          }
         }
-        else
-        {
-          fprintf(stderr, "[HDR Layer] VkHdrMetadataEXT: mastering luminance min %f nits, max %f nits\n", metadata.minLuminance, metadata.maxLuminance);
-          fprintf(stderr, "[HDR Layer] VkHdrMetadataEXT: maxContentLightLevel %f nits\n", metadata.maxContentLightLevel);
-          fprintf(stderr, "[HDR Layer] VkHdrMetadataEXT: maxFrameAverageLightLevel %f nits\n", metadata.maxFrameAverageLightLevel);
 
-          hdrSwapchain->colorDescription = desc;
-          hdrSwapchain->desc_dirty = true;
-        }
+        if (hdrSwapchain->pendingMetadata)
+          stats.merged++;
+        hdrSwapchain->pendingMetadata = metadata;
+        ApplyPendingMetadata(*hdrSurface, *hdrSwapchain);
       }
     }
 
@@ -736,13 +1705,32 @@ namespace HdrLayer
         VkQueue queue,
         const VkPresentInfoKHR *pPresentInfo)
     {
+      bool anySuboptimal = false;
       for (uint32_t i = 0; i < pPresentInfo->swapchainCount; i++)
       {
-        if (auto hdrSwapchain = HdrSwapchain::get(pPresentInfo->pSwapchains[i]))
+        wl_display *display = nullptr;
+        wl_event_queue *eventQueue = nullptr;
+        auto surface = swapchain_surface(pPresentInfo->pSwapchains[i], &display, &eventQueue);
+        if (!surface)
+          continue;
+
+        // Nothing in here waits for the compositor, new image descriptions
+        // are picked up by a later present once they are ready.
+        read_surface_events(display, eventQueue);
+
+        auto hdrSurface = HdrSurface::get(*surface);
+        auto hdrSwapchain = HdrSwapchain::get(pPresentInfo->pSwapchains[i]);
+        if (hdrSurface && hdrSwapchain)
         {
-          if (hdrSwapchain->desc_dirty)
+          wl_display_dispatch_queue_pending(display, eventQueue);
+          CollectPendingDescription(*hdrSwapchain);
+          UpdateSwapchainState(*hdrSurface, *hdrSwapchain);
+          if (hdrSwapchain->pendingMetadata)
+            ApplyPendingMetadata(*hdrSurface, *hdrSwapchain);
+          anySuboptimal |= hdrSwapchain->suboptimal;
+
+          if (hdrSwapchain->desc_dirty && hdrSurface->colorSurface)
           {
-            auto hdrSurface = HdrSurface::get(hdrSwapchain->surface);
             if (hdrSwapchain->colorDescription)
             {
               wp_color_management_surface_v1_set_image_description(hdrSurface->colorSurface, hdrSwapchain->colorDescription, WP_COLOR_MANAGER_V1_RENDER_INTENT_PERCEPTUAL);
@@ -756,29 +1744,285 @@ namespace HdrLayer
         }
       }
 
-      return pDispatch->QueuePresentKHR(queue, pPresentInfo);
+      VkResult result = pDispatch->QueuePresentKHR(queue, pPresentInfo);
+      if (anySuboptimal)
+      {
+        for (uint32_t i = 0; pPresentInfo->pResults && i < pPresentInfo->swapchainCount; i++)
+        {
+          if (pPresentInfo->pResults[i] != VK_SUCCESS)
+            continue;
+          auto hdrSwapchain = HdrSwapchain::get(pPresentInfo->pSwapchains[i]);
+          if (hdrSwapchain && hdrSwapchain->suboptimal)
+            pPresentInfo->pResults[i] = VK_SUBOPTIMAL_KHR;
+        }
+        if (result == VK_SUCCESS)
+          result = VK_SUBOPTIMAL_KHR;
+      }
+
+      if (trace_header())
+      {
+        for (uint32_t i = 0; i < pPresentInfo->swapchainCount; i++)
+        {
+          VkResult swapchainResult = pPresentInfo->pResults ? pPresentInfo->pResults[i] : result;
+          trace_append(TraceType::QueuePresent, trace_handle(pPresentInfo->pSwapchains[i]), trace_handle(queue), swapchainResult);
+        }
+      }
+      return result;
     }
 
   private:
-    static constexpr struct wp_image_description_v1_listener image_description_interface_listener
+    // The map locks are always taken surface first, then swapchain, as
+    // CreateSwapchainKHR holds the surface while creating the swapchain. So the
+    // swapchain's surface is looked up on its own, with nothing else locked.
+    static std::optional<VkSurfaceKHR> swapchain_surface(VkSwapchainKHR swapchain, wl_display **pDisplay = nullptr, wl_event_queue **pQueue = nullptr)
     {
-      .failed = [](
-                    void *data,
-                    struct wp_image_description_v1 *wp_image_description_v1,
-                    uint32_t cause,
-                    const char *msg)
+      auto hdrSwapchain = HdrSwapchain::get(swapchain);
+      if (!hdrSwapchain)
+        return std::nullopt;
+      if (pDisplay)
+        *pDisplay = hdrSwapchain->display;
+      if (pQueue)
+        *pQueue = hdrSwapchain->queue;
+      return hdrSwapchain->surface;
+    }
+
+    static void SetPresentHints(VkSurfaceKHR vkSurface, VkPresentModeKHR presentMode)
+    {
+      auto hints = HintSurface::get(vkSurface);
+      if (!hints)
+        return;
+
+      // pick up globals that went away
+      wl_display_dispatch_queue_pending(hints->display, hints->queue);
+
+      if (hints->tearingControlMgr)
       {
-        fprintf(stderr, "[HDR Layer] Image description failed: Cause %u, message: %s.\n", cause, msg);
-        auto state = reinterpret_cast<enum DescStatus *>(data);
-        *state = DescStatus::FAILED;
-      },
-      .ready = [](void *data, struct wp_image_description_v1 *wp_image_description_v1, uint32_t identity)
+        bool async = presentMode == VK_PRESENT_MODE_IMMEDIATE_KHR;
+        if (!hints->tearingControl && async)
+          hints->tearingControl = wp_tearing_control_manager_v1_get_tearing_control(hints->tearingControlMgr, hints->surface);
+        if (hints->tearingControl)
+          wp_tearing_control_v1_set_presentation_hint(hints->tearingControl, async ? WP_TEARING_CONTROL_V1_PRESENTATION_HINT_ASYNC : WP_TEARING_CONTROL_V1_PRESENTATION_HINT_VSYNC);
+      }
+
+      if (hints->contentTypeMgr)
       {
-        auto state = reinterpret_cast<enum DescStatus *>(data);
-        *state = DescStatus::READY;
+        bool lowLatency = presentMode == VK_PRESENT_MODE_IMMEDIATE_KHR || presentMode == VK_PRESENT_MODE_MAILBOX_KHR;
+        uint32_t contentType = *configured_content_type();
+        if (contentType == s_ContentTypeAuto)
+          contentType = lowLatency ? WP_CONTENT_TYPE_V1_TYPE_GAME : WP_CONTENT_TYPE_V1_TYPE_NONE;
+        if (!hints->contentType && contentType != WP_CONTENT_TYPE_V1_TYPE_NONE)
+          hints->contentType = wp_content_type_manager_v1_get_surface_content_type(hints->contentTypeMgr, hints->surface);
+        if (hints->contentType)
+          wp_content_type_v1_set_content_type(hints->contentType, contentType);
       }
-      // we don't call get_information, so the rest should never be called
-    };
+
+      wl_display_flush(hints->display);
+    }
+
+    // Starts a new image description for pending metadata, unless that would
+    // exceed the configured rate or another one is still being created, in
+    // which case QueuePresentKHR retries later.
+    static void ApplyPendingMetadata(HdrSurfaceData &surface, HdrSwapchainData &swapchain)
+    {
+      const VkHdrMetadataEXT metadata = *swapchain.pendingMetadata;
+
+      if (!surface.colorManagement || surface.capsSync || swapchain.managerGeneration != surface.managerGeneration)
+      {
+        // Picked up by UpdateSwapchainState once the color manager is back,
+        // descriptions of the previous one are dead already.
+        DestroyDescriptions(swapchain);
+        swapchain.metadata = metadata;
+        swapchain.pendingMetadata.reset();
+        return;
+      }
+
+      if (swapchain.pendingDescription)
+        return;
+
+      auto now = std::chrono::steady_clock::now();
+      const MetadataCoalescing &config = metadata_coalescing();
+      if (config.maxRate > 0.0 && now - swapchain.lastMetadataChange < std::chrono::duration<double>(1.0 / config.maxRate))
+        return;
+
+      swapchain.pendingMetadata.reset();
+      StartImageDescription(surface, swapchain, &metadata);
+
+      fprintf(stderr, "[HDR Layer] VkHdrMetadataEXT: mastering luminance min %f nits, max %f nits\n", metadata.minLuminance, metadata.maxLuminance);
+      fprintf(stderr, "[HDR Layer] VkHdrMetadataEXT: maxContentLightLevel %f nits\n", metadata.maxContentLightLevel);
+      fprintf(stderr, "[HDR Layer] VkHdrMetadataEXT: maxFrameAverageLightLevel %f nits\n", metadata.maxFrameAverageLightLevel);
+
+      swapchain.lastMetadataChange = now;
+      swapchain.metadataStats.applied++;
+    }
+
+    static bool IsColorSpaceOptimal(const HdrSurfaceData &surface, VkColorSpaceKHR colorSpace)
+    {
+      if (!supports_color_space(surface, colorSpace))
+        return false;
+
+      // HDR content on a surface the compositor would rather have in SDR
+      // (e.g. moved to an SDR output) just costs a tone-mapping pass.
+      const PreferredDescription &preferred = surface.preferred;
+      auto desc = find_description(colorSpace);
+      bool preferredKnown = preferred.primaries_cicp != 0 || preferred.tf_cicp != 0;
+      if (desc && is_hdr(*desc) && preferredKnown && !is_hdr(preferred.primaries_cicp, preferred.tf_cicp, false))
+        return false;
+
+      return true;
+    }
+
+    // Reconciles a swapchain with runtime changes of its surface's color management state.
+    static void UpdateSwapchainState(HdrSurfaceData &surface, HdrSwapchainData &swapchain)
+    {
+      if (swapchain.managerGeneration != surface.managerGeneration)
+      {
+        // The descriptions belong to a color manager that is gone,
+        // present untagged until a new one is ready.
+        DestroyDescriptions(swapchain);
+        swapchain.managerGeneration = surface.managerGeneration;
+      }
+
+      // The capabilities of a newly bound color manager are still on their way
+      if (surface.capsSync || swapchain.capsSerial == surface.capsSerial)
+        return;
+      swapchain.capsSerial = surface.capsSerial;
+
+      bool supported = supports_color_space(surface, swapchain.colorSpace);
+      if (!supported)
+        DestroyDescriptions(swapchain);
+      else if (!swapchain.colorDescription && !swapchain.pendingDescription && swapchain.primaries != 0 && swapchain.tf != 0)
+        StartImageDescription(surface, swapchain, swapchain.metadata ? &*swapchain.metadata : nullptr);
+
+      bool optimal = IsColorSpaceOptimal(surface, swapchain.colorSpace);
+      if (swapchain.optimal && !optimal)
+      {
+        fprintf(stderr, "[HDR Layer] Colorspace %s is no longer %s for id: %u, reporting suboptimal\n",
+                vkroots::helpers::enumString(swapchain.colorSpace),
+                supported ? "optimal" : "supported",
+                wl_proxy_get_id(reinterpret_cast<struct wl_proxy *>(surface.surface)));
+        swapchain.suboptimal = true;
+      }
+      else if (optimal && swapchain.suboptimal)
+      {
+        // e.g. moved back to an HDR output before the app got around to recreating
+        fprintf(stderr, "[HDR Layer] Colorspace %s is optimal again for id: %u\n",
+                vkroots::helpers::enumString(swapchain.colorSpace),
+                wl_proxy_get_id(reinterpret_cast<struct wl_proxy *>(surface.surface)));
+        swapchain.suboptimal = false;
+      }
+      swapchain.optimal = optimal;
+    }
+
+    static void DestroyDescriptions(HdrSwapchainData &swapchain)
+    {
+      if (swapchain.colorDescription)
+      {
+        wp_image_description_v1_destroy(swapchain.colorDescription);
+        swapchain.colorDescription = nullptr;
+        swapchain.desc_dirty = true;
+      }
+      if (swapchain.pendingDescription)
+      {
+        // Never answered, so recreate it with the latest metadata
+        wp_image_description_v1_destroy(swapchain.pendingDescription);
+        swapchain.pendingDescription = nullptr;
+        swapchain.metadata = swapchain.pendingDescriptionMetadata;
+      }
+    }
+
+    // Swaps in the pending description once the compositor answered.
+    static void CollectPendingDescription(HdrSwapchainData &swapchain)
+    {
+      if (!swapchain.pendingDescription || swapchain.pendingStatus == DescStatus::WAITING)
+        return;
+
+      if (swapchain.pendingStatus == DescStatus::READY)
+      {
+        if (swapchain.colorDescription)
+          wp_image_description_v1_destroy(swapchain.colorDescription);
+        swapchain.colorDescription = swapchain.pendingDescription;
+        swapchain.metadata = swapchain.pendingDescriptionMetadata;
+        swapchain.desc_dirty = true;
+      }
+      else
+      {
+        // The metadata stays the one of the description still in use
+        fprintf(stderr, "[HDR Layer] Failed to create new image description, keeping the previous one\n");
+        wp_image_description_v1_destroy(swapchain.pendingDescription);
+      }
+      swapchain.pendingDescription = nullptr;
+    }
+
+    static void StartImageDescription(HdrSurfaceData &surface, HdrSwapchainData &swapchain, const VkHdrMetadataEXT *pMetadata)
+    {
+      if (swapchain.pendingDescription)
+        wp_image_description_v1_destroy(swapchain.pendingDescription);
+
+      swapchain.pendingStatus = DescStatus::WAITING;
+      swapchain.pendingDescriptionMetadata = pMetadata ? std::optional(*pMetadata) : std::nullopt;
+      swapchain.pendingDescription = RequestImageDescription(surface, swapchain.primaries, swapchain.tf, pMetadata);
+      wp_image_description_v1_add_listener(swapchain.pendingDescription, &image_description_interface_listener, &swapchain.pendingStatus);
+      wl_display_flush(surface.display);
+    }
+
+    static wp_image_description_v1 *CreateImageDescription(
+        HdrSurfaceData &surface,
+        int primaries,
+        int tf,
+        const VkHdrMetadataEXT *pMetadata)
+    {
+      auto status = DescStatus::WAITING;
+      wp_image_description_v1 *desc = RequestImageDescription(surface, primaries, tf, pMetadata);
+      wp_image_description_v1_add_listener(desc, &image_description_interface_listener, &status);
+      while (status == DescStatus::WAITING)
+      {
+        wl_display_roundtrip_queue(surface.display, surface.queue);
+      }
+      if (status == DescStatus::FAILED)
+      {
+        wp_image_description_v1_destroy(desc);
+        return nullptr;
+      }
+      return desc;
+    }
+
+    static wp_image_description_v1 *RequestImageDescription(
+        HdrSurfaceData &surface,
+        int primaries,
+        int tf,
+        const VkHdrMetadataEXT *pMetadata)
+    {
+      wp_image_description_creator_params_v1 *params = wp_color_manager_v1_new_parametric_creator(surface.colorManagement);
+      if (pMetadata)
+      {
+        const VkHdrMetadataEXT &metadata = *pMetadata;
+        wp_image_description_creator_params_v1_set_mastering_display_primaries(
+            params,
+            (uint32_t)round(metadata.displayPrimaryRed.x * 10000.0),
+            (uint32_t)round(metadata.displayPrimaryRed.y * 10000.0),
+            (uint32_t)round(metadata.displayPrimaryGreen.x * 10000.0),
+            (uint32_t)round(metadata.displayPrimaryGreen.y * 10000.0),
+            (uint32_t)round(metadata.displayPrimaryBlue.x * 10000.0),
+            (uint32_t)round(metadata.displayPrimaryBlue.y * 10000.0),
+            (uint32_t)round(metadata.whitePoint.x * 10000.0),
+            (uint32_t)round(metadata.whitePoint.y * 10000.0));
+        wp_image_description_creator_params_v1_set_mastering_luminance(
+            params,
+            (uint32_t)round(metadata.minLuminance * 10000.0),
+            (uint32_t)round(metadata.maxLuminance));
+      }
+      wp_image_description_creator_params_v1_set_primaries_cicp(params, primaries);
+      wp_image_description_creator_params_v1_set_tf_cicp(params, tf);
+      if (pMetadata)
+      {
+        wp_image_description_creator_params_v1_set_max_cll(params, (uint32_t)round(pMetadata->maxContentLightLevel));
+        wp_image_description_creator_params_v1_set_max_fall(params, (uint32_t)round(pMetadata->maxFrameAverageLightLevel));
+      }
+
+      wp_image_description_v1 *desc = wp_image_description_creator_params_v1_create(params);
+      wp_image_description_creator_params_v1_destroy(params);
+      return desc;
+    }
   };
 }
 
@@ -788,3 +2032,6 @@ VKROOTS_DEFINE_LAYER_INTERFACES(HdrLayer::VkInstanceOverrides,
 
 VKROOTS_IMPLEMENT_SYNCHRONIZED_MAP_TYPE(HdrLayer::HdrSurface);
 VKROOTS_IMPLEMENT_SYNCHRONIZED_MAP_TYPE(HdrLayer::HdrSwapchain);
+VKROOTS_IMPLEMENT_SYNCHRONIZED_MAP_TYPE(HdrLayer::HintSurface);
+VKROOTS_IMPLEMENT_SYNCHRONIZED_MAP_TYPE(HdrLayer::HdrOverlaySurface);
+VKROOTS_IMPLEMENT_SYNCHRONIZED_MAP_TYPE(HdrLayer::HdrInstance);
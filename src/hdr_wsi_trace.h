@@ -0,0 +1,73 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+// Binary trace of the WSI calls seen by the layer, written with HDR_WSI_TRACE=<path>.
+//
+// The file is a TraceHeader followed by `capacity` fixed size TraceRecords.
+// Writers claim a slot with a single atomic increment of `count`, records past
+// `capacity` are dropped (but still counted).
+namespace HdrLayer
+{
+  static constexpr char s_TraceMagic[8] = {'H', 'D', 'R', 'W', 'S', 'I', 'T', 'R'};
+  static constexpr uint32_t s_TraceVersion = 1;
+
+  enum class TraceType : uint32_t
+  {
+    CreateSurface,
+    DestroySurface,
+    CreateSwapchain,
+    DestroySwapchain,
+    SetHdrMetadata,
+    QueuePresent,
+  };
+
+  struct TraceHeader
+  {
+    char magic[8];
+    uint32_t version;
+    uint32_t recordSize;
+    uint64_t capacity;
+    std::atomic<uint64_t> count;
+  };
+  static_assert(std::atomic<uint64_t>::is_always_lock_free);
+
+  struct TraceSwapchainInfo
+  {
+    uint32_t format;
+    uint32_t colorSpace;
+    uint32_t presentMode;
+    uint32_t width;
+    uint32_t height;
+    uint32_t imageCount;
+  };
+
+  struct TraceMetadata
+  {
+    float displayPrimaryRed[2];
+    float displayPrimaryGreen[2];
+    float displayPrimaryBlue[2];
+    float whitePoint[2];
+    float maxLuminance;
+    float minLuminance;
+    float maxContentLightLevel;
+    float maxFrameAverageLightLevel;
+  };
+
+  struct TraceRecord
+  {
+    uint64_t timestampNs; // CLOCK_MONOTONIC
+    TraceType type;
+    int32_t result; // VkResult where applicable
+    uint64_t object;  // VkSurfaceKHR or VkSwapchainKHR
+    uint64_t parent;  // VkSurfaceKHR of a swapchain, VkQueue of a present
+    union
+    {
+      TraceSwapchainInfo swapchain;
+      TraceMetadata metadata;
+      uint32_t overlay; // CreateSurface: VK_HDRWSI_sdr_overlay surface
+    };
+  };
+  static_assert(sizeof(TraceRecord) == 80);
+}
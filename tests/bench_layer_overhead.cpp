@@ -0,0 +1,212 @@
+// Cost of the layer on the per-frame WSI calls: vkQueuePresentKHR (with the
+// acquire in front of it) and vkSetHdrMetadataEXT, with the layer off and on,
+// through the loader against the stub ICD and the mock compositor. Reports
+// ns/call and heap allocations per call made on the calling thread, which
+// covers the loader, the layer, libwayland-client and the stub ICD, but not
+// the compositor.
+//
+// bench-layer-overhead [frames]
+#include "harness.h"
+
+#include <chrono>
+#include <cinttypes>
+#include <cmath>
+#include <cstring>
+#include <optional>
+
+// Allocation counting, on the benchmark thread only. Everything in the process
+// resolves malloc & co. to these, glibc's own implementation stays reachable
+// through the __libc_ aliases.
+extern "C"
+{
+  void *__libc_malloc(size_t size);
+  void *__libc_calloc(size_t count, size_t size);
+  void *__libc_realloc(void *ptr, size_t size);
+  void __libc_free(void *ptr);
+}
+
+static thread_local bool t_countAllocations = false;
+static thread_local uint64_t t_allocations = 0;
+
+extern "C"
+{
+  void *malloc(size_t size) noexcept
+  {
+    if (t_countAllocations)
+      t_allocations++;
+    return __libc_malloc(size);
+  }
+
+  void *calloc(size_t count, size_t size) noexcept
+  {
+    if (t_countAllocations)
+      t_allocations++;
+    return __libc_calloc(count, size);
+  }
+
+  void *realloc(void *ptr, size_t size) noexcept
+  {
+    if (t_countAllocations)
+      t_allocations++;
+    return __libc_realloc(ptr, size);
+  }
+
+  void free(void *ptr) noexcept
+  {
+    __libc_free(ptr);
+  }
+}
+
+using namespace HdrLayerTest;
+
+namespace
+{
+  struct Scenario
+  {
+    const char *name;
+    bool layer;
+    VkFormat format;
+    VkColorSpaceKHR colorSpace;
+    // Applications only send metadata for HDR swapchains, the layer off
+    // baseline is just the loader and the driver
+    bool metadata;
+  };
+
+  struct Result
+  {
+    double presentNs;
+    double presentAllocs;
+    double metadataNs;
+    double metadataAllocs;
+  };
+
+  struct Measurement
+  {
+    std::chrono::steady_clock::time_point start;
+
+    static Measurement begin()
+    {
+      t_allocations = 0;
+      t_countAllocations = true;
+      return Measurement{.start = std::chrono::steady_clock::now()};
+    }
+
+    // ns and allocations per call
+    std::pair<double, double> end(uint32_t calls)
+    {
+      auto elapsed = std::chrono::steady_clock::now() - start;
+      t_countAllocations = false;
+      return {double(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()) / calls,
+              double(t_allocations) / calls};
+    }
+  };
+
+  // Content light levels wandering within a few nits, like a game reporting
+  // per-frame values; mostly coalesced away by the layer.
+  VkHdrMetadataEXT frame_metadata(uint32_t frame)
+  {
+    float wobble = float(std::sin(frame * 0.1)) * 4.0f;
+    return VkHdrMetadataEXT{
+        .sType = VK_STRUCTURE_TYPE_HDR_METADATA_EXT,
+        .displayPrimaryRed = {0.708f, 0.292f},
+        .displayPrimaryGreen = {0.170f, 0.797f},
+        .displayPrimaryBlue = {0.131f, 0.046f},
+        .whitePoint = {0.3127f, 0.3290f},
+        .maxLuminance = 1000.0f,
+        .minLuminance = 0.005f,
+        .maxContentLightLevel = 800.0f + wobble,
+        .maxFrameAverageLightLevel = 200.0f + wobble,
+    };
+  }
+
+  Result run(const Scenario &scenario, uint32_t frames)
+  {
+    Harness harness({.layer = scenario.layer});
+    VkSurfaceKHR surface = harness.createSurface(harness.createWlSurface());
+    VkSwapchainKHR swapchain = harness.createSwapchain(surface, VK_PRESENT_MODE_FIFO_KHR, scenario.format, scenario.colorSpace);
+    harness.roundtrip();
+
+    // Keeps the socket drained and the compositor's log out of the numbers
+    static constexpr uint32_t s_Batch = 1000;
+    auto batches = [&](auto &&body)
+    {
+      for (uint32_t done = 0; done < frames; done += s_Batch)
+      {
+        uint32_t count = std::min(s_Batch, frames - done);
+        body(done, count);
+        harness.roundtrip();
+      }
+    };
+
+    for (uint32_t i = 0; i < s_Batch; i++)
+      CHECK(harness.present(swapchain) >= 0);
+    harness.roundtrip();
+
+    Result result = {};
+    batches([&](uint32_t first, uint32_t count)
+            {
+              Measurement measurement = Measurement::begin();
+              for (uint32_t i = 0; i < count; i++)
+                CHECK(harness.present(swapchain) >= 0);
+              auto [ns, allocs] = measurement.end(count);
+              result.presentNs += ns * count / frames;
+              result.presentAllocs += allocs * count / frames; });
+
+    if (scenario.metadata)
+    {
+      batches([&](uint32_t first, uint32_t count)
+              {
+                std::vector<VkHdrMetadataEXT> metadata;
+                for (uint32_t i = 0; i < count; i++)
+                  metadata.push_back(frame_metadata(first + i));
+
+                Measurement measurement = Measurement::begin();
+                for (uint32_t i = 0; i < count; i++)
+                  harness.setHdrMetadata(swapchain, metadata[i]);
+                auto [ns, allocs] = measurement.end(count);
+                result.metadataNs += ns * count / frames;
+                result.metadataAllocs += allocs * count / frames; });
+    }
+
+    harness.destroySwapchain(swapchain);
+    harness.destroySurface(surface);
+    CHECK(harness.connected());
+    return result;
+  }
+}
+
+int main(int argc, char **argv)
+{
+  uint32_t frames = argc > 1 ? uint32_t(strtoul(argv[1], nullptr, 10)) : 20000;
+  CHECK(frames > 0);
+
+  static constexpr Scenario s_Scenarios[] = {
+      {"layer off, sRGB", false, VK_FORMAT_B8G8R8A8_UNORM, VK_COLOR_SPACE_SRGB_NONLINEAR_KHR, true},
+      {"layer on, sRGB", true, VK_FORMAT_B8G8R8A8_UNORM, VK_COLOR_SPACE_SRGB_NONLINEAR_KHR, false},
+      {"layer on, HDR10", true, VK_FORMAT_A2B10G10R10_UNORM_PACK32, VK_COLOR_SPACE_HDR10_ST2084_EXT, true},
+  };
+
+  printf("%u frames per scenario\n", frames);
+  printf("%-18s %14s %14s %14s %14s\n", "", "present ns", "present allocs", "metadata ns", "metadata allocs");
+
+  std::optional<Result> baseline;
+  for (const Scenario &scenario : s_Scenarios)
+  {
+    Result result = run(scenario, frames);
+    printf("%-18s %14.0f %14.2f", scenario.name, result.presentNs, result.presentAllocs);
+    if (scenario.metadata)
+      printf(" %14.0f %14.2f", result.metadataNs, result.metadataAllocs);
+    printf("\n");
+
+    if (!baseline)
+    {
+      baseline = result;
+      continue;
+    }
+    printf("%-18s %+14.0f %+14.2f", "  vs. layer off", result.presentNs - baseline->presentNs, result.presentAllocs - baseline->presentAllocs);
+    if (scenario.metadata)
+      printf(" %+14.0f %+14.2f", result.metadataNs - baseline->metadataNs, result.metadataAllocs - baseline->metadataAllocs);
+    printf("\n");
+  }
+  return 0;
+}
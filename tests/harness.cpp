@@ -0,0 +1,225 @@
+#include "harness.h"
+
+#include <vk_hdrwsi_sdr_overlay.h>
+
+#include <cstring>
+#include <dlfcn.h>
+
+namespace HdrLayerTest
+{
+  namespace
+  {
+    const wl_registry_listener s_registryListener = {
+        .global = [](void *data, wl_registry *registry, uint32_t name, const char *interface, uint32_t version)
+        {
+          if (strcmp(interface, wl_compositor_interface.name) == 0)
+            *static_cast<wl_compositor **>(data) = static_cast<wl_compositor *>(wl_registry_bind(registry, name, &wl_compositor_interface, 4));
+        },
+        .global_remove = [](void *data, wl_registry *registry, uint32_t name) {},
+    };
+  }
+
+  Harness::Harness(const HarnessConfig &config)
+      : m_compositor(config.compositor)
+  {
+    // Only the stub ICD and the layer from this build, whatever is installed
+    setenv("VK_DRIVER_FILES", HDR_WSI_TEST_ICD_MANIFEST, 1);
+    setenv("VK_ICD_FILENAMES", HDR_WSI_TEST_ICD_MANIFEST, 1);
+    setenv("VK_LAYER_PATH", HDR_WSI_TEST_LAYER_DIR, 1);
+    setenv("VK_LOADER_LAYERS_DISABLE", "~implicit~", 1);
+
+    m_display = wl_display_connect_to_fd(m_compositor.takeClientFd());
+    CHECK(m_display);
+    m_registry = wl_display_get_registry(m_display);
+    wl_registry_add_listener(m_registry, &s_registryListener, &m_wlCompositor);
+    wl_display_roundtrip(m_display);
+    CHECK(m_wlCompositor);
+
+    std::vector<const char *> layers;
+    std::vector<const char *> instanceExtensions = {
+        VK_KHR_SURFACE_EXTENSION_NAME,
+        VK_KHR_WAYLAND_SURFACE_EXTENSION_NAME,
+    };
+    if (config.layer)
+    {
+      layers.push_back("VK_LAYER_hdr_wsi");
+      instanceExtensions.push_back(VK_EXT_SWAPCHAIN_COLOR_SPACE_EXTENSION_NAME);
+    }
+    if (config.sdrOverlay)
+      instanceExtensions.push_back(VK_HDRWSI_SDR_OVERLAY_EXTENSION_NAME);
+
+    const VkApplicationInfo appInfo = {
+        .sType = VK_STRUCTURE_TYPE_APPLICATION_INFO,
+        .pApplicationName = "hdr-wsi-test",
+        .apiVersion = VK_API_VERSION_1_3,
+    };
+    const VkInstanceCreateInfo instanceInfo = {
+        .sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO,
+        .pApplicationInfo = &appInfo,
+        .enabledLayerCount = uint32_t(layers.size()),
+        .ppEnabledLayerNames = layers.data(),
+        .enabledExtensionCount = uint32_t(instanceExtensions.size()),
+        .ppEnabledExtensionNames = instanceExtensions.data(),
+    };
+    CHECK(vkCreateInstance(&instanceInfo, nullptr, &m_instance) == VK_SUCCESS);
+
+    uint32_t count = 1;
+    CHECK(vkEnumeratePhysicalDevices(m_instance, &count, &m_physicalDevice) == VK_SUCCESS);
+
+    const float priority = 1.0f;
+    const VkDeviceQueueCreateInfo queueInfo = {
+        .sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
+        .queueFamilyIndex = 0,
+        .queueCount = 1,
+        .pQueuePriorities = &priority,
+    };
+    const char *deviceExtensions[] = {
+        VK_KHR_SWAPCHAIN_EXTENSION_NAME,
+        VK_EXT_HDR_METADATA_EXTENSION_NAME,
+    };
+    const VkDeviceCreateInfo deviceInfo = {
+        .sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,
+        .queueCreateInfoCount = 1,
+        .pQueueCreateInfos = &queueInfo,
+        .enabledExtensionCount = 2,
+        .ppEnabledExtensionNames = deviceExtensions,
+    };
+    CHECK(vkCreateDevice(m_physicalDevice, &deviceInfo, nullptr, &m_device) == VK_SUCCESS);
+    vkGetDeviceQueue(m_device, 0, 0, &m_queue);
+    m_setHdrMetadata = reinterpret_cast<PFN_vkSetHdrMetadataEXT>(vkGetDeviceProcAddr(m_device, "vkSetHdrMetadataEXT"));
+    CHECK(m_setHdrMetadata);
+
+    // The loader already opened the ICD, this just gets another reference
+    m_icd = dlopen(HDR_WSI_TEST_ICD_LIBRARY, RTLD_NOW);
+    CHECK(m_icd);
+    m_setIcdHooks = reinterpret_cast<PFN_stub_icd_set_hooks>(dlsym(m_icd, "stub_icd_set_hooks"));
+    CHECK(m_setIcdHooks);
+  }
+
+  Harness::~Harness()
+  {
+    m_setIcdHooks(nullptr);
+    dlclose(m_icd);
+
+    vkDestroyDevice(m_device, nullptr);
+    vkDestroyInstance(m_instance, nullptr);
+
+    for (wl_surface *surface : m_wlSurfaces)
+      wl_surface_destroy(surface);
+    wl_compositor_destroy(m_wlCompositor);
+    wl_registry_destroy(m_registry);
+    wl_display_roundtrip(m_display);
+    wl_display_disconnect(m_display);
+  }
+
+  void Harness::setIcdHooks(const StubIcdHooks &hooks)
+  {
+    m_setIcdHooks(&hooks);
+  }
+
+  void Harness::roundtrip()
+  {
+    wl_display_roundtrip(m_display);
+  }
+
+  bool Harness::connected() const
+  {
+    return wl_display_get_error(m_display) == 0;
+  }
+
+  wl_surface *Harness::createWlSurface()
+  {
+    wl_surface *surface = wl_compositor_create_surface(m_wlCompositor);
+    m_wlSurfaces.push_back(surface);
+    return surface;
+  }
+
+  VkSurfaceKHR Harness::createSurface(wl_surface *surface, const void *pNext)
+  {
+    const VkWaylandSurfaceCreateInfoKHR createInfo = {
+        .sType = VK_STRUCTURE_TYPE_WAYLAND_SURFACE_CREATE_INFO_KHR,
+        .pNext = pNext,
+        .display = m_display,
+        .surface = surface,
+    };
+    VkSurfaceKHR vkSurface = VK_NULL_HANDLE;
+    CHECK(vkCreateWaylandSurfaceKHR(m_instance, &createInfo, nullptr, &vkSurface) == VK_SUCCESS);
+    return vkSurface;
+  }
+
+  void Harness::destroySurface(VkSurfaceKHR surface)
+  {
+    vkDestroySurfaceKHR(m_instance, surface, nullptr);
+  }
+
+  VkSwapchainKHR Harness::createSwapchain(VkSurfaceKHR surface, VkPresentModeKHR presentMode,
+                                          VkFormat format, VkColorSpaceKHR colorSpace, VkSwapchainKHR oldSwapchain)
+  {
+    const VkSwapchainCreateInfoKHR createInfo = {
+        .sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR,
+        .surface = surface,
+        .minImageCount = 3,
+        .imageFormat = format,
+        .imageColorSpace = colorSpace,
+        .imageExtent = {640, 480},
+        .imageArrayLayers = 1,
+        .imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT,
+        .imageSharingMode = VK_SHARING_MODE_EXCLUSIVE,
+        .preTransform = VK_SURFACE_TRANSFORM_IDENTITY_BIT_KHR,
+        .compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR,
+        .presentMode = presentMode,
+        .clipped = VK_TRUE,
+        .oldSwapchain = oldSwapchain,
+    };
+    VkSwapchainKHR swapchain = VK_NULL_HANDLE;
+    CHECK(vkCreateSwapchainKHR(m_device, &createInfo, nullptr, &swapchain) == VK_SUCCESS);
+    return swapchain;
+  }
+
+  void Harness::destroySwapchain(VkSwapchainKHR swapchain)
+  {
+    vkDestroySwapchainKHR(m_device, swapchain, nullptr);
+  }
+
+  VkResult Harness::present(VkSwapchainKHR swapchain)
+  {
+    uint32_t imageIndex = 0;
+    VkResult result = vkAcquireNextImageKHR(m_device, swapchain, UINT64_MAX, VK_NULL_HANDLE, VK_NULL_HANDLE, &imageIndex);
+    if (result < 0)
+      return result;
+
+    const VkPresentInfoKHR presentInfo = {
+        .sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR,
+        .swapchainCount = 1,
+        .pSwapchains = &swapchain,
+        .pImageIndices = &imageIndex,
+    };
+    return vkQueuePresentKHR(m_queue, &presentInfo);
+  }
+
+  VkResult Harness::present(const std::vector<VkSwapchainKHR> &swapchains, std::vector<VkResult> &results)
+  {
+    std::vector<uint32_t> imageIndices(swapchains.size());
+    for (size_t i = 0; i < swapchains.size(); i++)
+    {
+      VkResult result = vkAcquireNextImageKHR(m_device, swapchains[i], UINT64_MAX, VK_NULL_HANDLE, VK_NULL_HANDLE, &imageIndices[i]);
+      if (result < 0)
+        return result;
+    }
+
+    results.assign(swapchains.size(), VK_RESULT_MAX_ENUM);
+    const VkPresentInfoKHR presentInfo = {
+        .sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR,
+        .swapchainCount = uint32_t(swapchains.size()),
+        .pSwapchains = swapchains.data(),
+        .pImageIndices = imageIndices.data(),
+        .pResults = results.data(),
+    };
+    return vkQueuePresentKHR(m_queue, &presentInfo);
+  }
+
+  void Harness::setHdrMetadata(VkSwapchainKHR swapchain, const VkHdrMetadataEXT &metadata)
+  {
+    m_setHdrMetadata(m_device, 1, &swapchain, &metadata);
+  }
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#define VK_USE_PLATFORM_WAYLAND_KHR
+#include <vulkan/vulkan.h>
+#include <wayland-client.h>
+
+#include "mock_compositor.h"
+#include "stub_icd.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+// Fails the test with the location of the check.
+#define CHECK(expr)                                                                 \
+  do                                                                                \
+  {                                                                                 \
+    if (!(expr))                                                                    \
+    {                                                                               \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #expr);      \
+      exit(1);                                                                      \
+    }                                                                               \
+  } while (0)
+
+namespace HdrLayerTest
+{
+  struct HarnessConfig
+  {
+    // Enable VK_LAYER_hdr_wsi, off measures the stub ICD alone
+    bool layer = true;
+    // Enable VK_HDRWSI_sdr_overlay on the instance
+    bool sdrOverlay = false;
+    MockCompositorConfig compositor = {};
+  };
+
+  // A Vulkan instance and device on the stub ICD, going through the loader
+  // and the layer built in this tree, and a Wayland connection to a mock
+  // compositor. Everything runs on the calling thread, except the compositor.
+  class Harness
+  {
+  public:
+    explicit Harness(const HarnessConfig &config = {});
+    ~Harness();
+
+    Harness(const Harness &) = delete;
+    Harness &operator=(const Harness &) = delete;
+
+    MockCompositor &compositor() { return m_compositor; }
+    wl_display *display() const { return m_display; }
+    VkInstance instance() const { return m_instance; }
+    VkDevice device() const { return m_device; }
+    VkQueue queue() const { return m_queue; }
+
+    // Called by the stub ICD, see StubIcdHooks
+    void setIcdHooks(const StubIcdHooks &hooks);
+
+    // Waits until the compositor handled everything sent so far
+    void roundtrip();
+    // No protocol error was raised on the connection
+    bool connected() const;
+
+    wl_surface *createWlSurface();
+    VkSurfaceKHR createSurface(wl_surface *surface, const void *pNext = nullptr);
+    void destroySurface(VkSurfaceKHR surface);
+
+    VkSwapchainKHR createSwapchain(VkSurfaceKHR surface, VkPresentModeKHR presentMode,
+                                   VkFormat format = VK_FORMAT_B8G8R8A8_UNORM,
+                                   VkColorSpaceKHR colorSpace = VK_COLOR_SPACE_SRGB_NONLINEAR_KHR,
+                                   VkSwapchainKHR oldSwapchain = VK_NULL_HANDLE);
+    void destroySwapchain(VkSwapchainKHR swapchain);
+
+    // Acquires and presents one image
+    VkResult present(VkSwapchainKHR swapchain);
+    // Acquires one image of each and presents them together, with their results
+    VkResult present(const std::vector<VkSwapchainKHR> &swapchains, std::vector<VkResult> &results);
+    void setHdrMetadata(VkSwapchainKHR swapchain, const VkHdrMetadataEXT &metadata);
+
+    static uint32_t id(void *proxy) { return wl_proxy_get_id(static_cast<wl_proxy *>(proxy)); }
+
+  private:
+    MockCompositor m_compositor;
+    wl_display *m_display = nullptr;
+    wl_registry *m_registry = nullptr;
+    wl_compositor *m_wlCompositor = nullptr;
+
+    VkInstance m_instance = VK_NULL_HANDLE;
+    VkPhysicalDevice m_physicalDevice = VK_NULL_HANDLE;
+    VkDevice m_device = VK_NULL_HANDLE;
+    VkQueue m_queue = VK_NULL_HANDLE;
+    PFN_vkSetHdrMetadataEXT m_setHdrMetadata = nullptr;
+
+    void *m_icd = nullptr;
+    PFN_stub_icd_set_hooks m_setIcdHooks = nullptr;
+
+    std::vector<wl_surface *> m_wlSurfaces;
+  };
+}
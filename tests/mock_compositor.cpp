@@ -0,0 +1,714 @@
+// In-process compositor for the layer tests, see mock_compositor.h.
+#include "mock_compositor.h"
+
+#include <wayland-server.h>
+#include "color-management-v1-protocol.h"
+#include "color-representation-v1-protocol.h"
+#include "content-type-v1-protocol.h"
+#include "tearing-control-v1-protocol.h"
+
+#include <algorithm>
+#include <array>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <future>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace HdrLayerTest
+{
+  struct MockCompositor::Impl
+  {
+    MockCompositorConfig config;
+    wl_display *display;
+    wl_protocol_logger *logger;
+    std::thread thread;
+    int clientFd;
+    uint32_t nextIdentity;
+    wl_global *colorManager;
+    // Only touched on the compositor thread
+    std::vector<wl_resource *> colorSurfaces;
+
+    // Work queued by run() for the compositor thread
+    int wakeFd;
+    wl_event_source *wakeSource;
+
+    mutable std::mutex mutex;
+    std::vector<MockRequest> requests;
+    // Per request name, so long replays don't have to scan the log
+    std::map<std::string, size_t, std::less<>> counts;
+    std::vector<std::function<void()>> work;
+
+    // Runs fn on the compositor thread and waits for it, events it sends are flushed.
+    void run(std::function<void()> fn);
+  };
+
+  namespace
+  {
+    using Impl = MockCompositor::Impl;
+
+    static constexpr std::array<uint32_t, 5> s_SupportedTf = {6, 8, 13, 16, 18};
+    static constexpr std::array<uint32_t, 4> s_SupportedPrimaries = {1, 6, 9, 13};
+
+    bool contains(const auto &values, uint32_t value)
+    {
+      return std::find(values.begin(), values.end(), value) != values.end();
+    }
+
+    // Objects created for a wl_surface share its state, but don't keep the surface alive.
+    struct SurfaceState
+    {
+      bool alive = true;
+      bool subsurface = false;
+      bool tearingControl = false;
+      bool contentType = false;
+      bool colorRepresentation = false;
+    };
+    using SurfaceRef = std::shared_ptr<SurfaceState>;
+
+    SurfaceRef &surface_ref(wl_resource *resource)
+    {
+      return *static_cast<SurfaceRef *>(wl_resource_get_user_data(resource));
+    }
+
+    void destroy_surface_ref(wl_resource *resource)
+    {
+      delete static_cast<SurfaceRef *>(wl_resource_get_user_data(resource));
+    }
+
+    void destroy_resource(wl_client *client, wl_resource *resource)
+    {
+      wl_resource_destroy(resource);
+    }
+
+    void log_request(void *data, wl_protocol_logger_type type, const wl_protocol_logger_message *message)
+    {
+      if (type != WL_PROTOCOL_LOGGER_REQUEST)
+        return;
+
+      MockRequest request = {
+          .name = std::string(wl_resource_get_class(message->resource)) + "." + message->message->name,
+          .object = wl_resource_get_id(message->resource),
+          .args = {},
+      };
+      int i = 0;
+      for (const char *c = message->message->signature; *c && i < message->arguments_count; c++)
+      {
+        const wl_argument &arg = message->arguments[i];
+        switch (*c)
+        {
+        case 'i':
+          request.args.push_back(uint32_t(arg.i));
+          break;
+        case 'u':
+          request.args.push_back(arg.u);
+          break;
+        case 'f':
+          request.args.push_back(uint32_t(arg.f));
+          break;
+        case 'n':
+          request.args.push_back(arg.n);
+          break;
+        case 'o':
+          // resolved objects are the wl_object at the start of their wl_resource
+          request.args.push_back(arg.o ? wl_resource_get_id(reinterpret_cast<wl_resource *>(arg.o)) : 0);
+          break;
+        case 's':
+        case 'a':
+        case 'h':
+          request.args.push_back(0);
+          break;
+        default:
+          continue; // since version and nullability
+        }
+        i++;
+      }
+
+      auto impl = static_cast<Impl *>(data);
+      std::lock_guard lock(impl->mutex);
+      impl->counts[request.name]++;
+      impl->requests.push_back(std::move(request));
+    }
+
+    // wl_compositor
+
+    const struct wl_region_interface s_regionImpl = {
+        .destroy = destroy_resource,
+        .add = [](wl_client *client, wl_resource *resource, int32_t x, int32_t y, int32_t width, int32_t height) {},
+        .subtract = [](wl_client *client, wl_resource *resource, int32_t x, int32_t y, int32_t width, int32_t height) {},
+    };
+
+    const struct wl_surface_interface s_surfaceImpl = {
+        .destroy = destroy_resource,
+        .attach = [](wl_client *client, wl_resource *resource, wl_resource *buffer, int32_t x, int32_t y) {},
+        .damage = [](wl_client *client, wl_resource *resource, int32_t x, int32_t y, int32_t width, int32_t height) {},
+        .frame = [](wl_client *client, wl_resource *resource, uint32_t callback)
+        {
+          wl_resource *done = wl_resource_create(client, &wl_callback_interface, 1, callback);
+          wl_callback_send_done(done, 0);
+          wl_resource_destroy(done);
+        },
+        .set_opaque_region = [](wl_client *client, wl_resource *resource, wl_resource *region) {},
+        .set_input_region = [](wl_client *client, wl_resource *resource, wl_resource *region) {},
+        .commit = [](wl_client *client, wl_resource *resource) {},
+        .set_buffer_transform = [](wl_client *client, wl_resource *resource, int32_t transform) {},
+        .set_buffer_scale = [](wl_client *client, wl_resource *resource, int32_t scale) {},
+        .damage_buffer = [](wl_client *client, wl_resource *resource, int32_t x, int32_t y, int32_t width, int32_t height) {},
+    };
+
+    const struct wl_compositor_interface s_compositorImpl = {
+        .create_surface = [](wl_client *client, wl_resource *resource, uint32_t id)
+        {
+          wl_resource *surface = wl_resource_create(client, &wl_surface_interface, wl_resource_get_version(resource), id);
+          wl_resource_set_implementation(surface, &s_surfaceImpl, new SurfaceRef(std::make_shared<SurfaceState>()),
+                                         [](wl_resource *surface)
+                                         {
+                                           surface_ref(surface)->alive = false;
+                                           destroy_surface_ref(surface);
+                                         });
+        },
+        .create_region = [](wl_client *client, wl_resource *resource, uint32_t id)
+        {
+          wl_resource *region = wl_resource_create(client, &wl_region_interface, wl_resource_get_version(resource), id);
+          wl_resource_set_implementation(region, &s_regionImpl, nullptr, nullptr);
+        },
+    };
+
+    // wl_subcompositor
+
+    const struct wl_subsurface_interface s_subsurfaceImpl = {
+        .destroy = destroy_resource,
+        .set_position = [](wl_client *client, wl_resource *resource, int32_t x, int32_t y) {},
+        .place_above = [](wl_client *client, wl_resource *resource, wl_resource *sibling) {},
+        .place_below = [](wl_client *client, wl_resource *resource, wl_resource *sibling) {},
+        .set_sync = [](wl_client *client, wl_resource *resource) {},
+        .set_desync = [](wl_client *client, wl_resource *resource) {},
+    };
+
+    const struct wl_subcompositor_interface s_subcompositorImpl = {
+        .destroy = destroy_resource,
+        .get_subsurface = [](wl_client *client, wl_resource *resource, uint32_t id, wl_resource *surface, wl_resource *parent)
+        {
+          if (surface == parent || surface_ref(surface)->subsurface)
+          {
+            wl_resource_post_error(resource, WL_SUBCOMPOSITOR_ERROR_BAD_SURFACE, "wl_surface@%u is already a sub-surface or its own parent", wl_resource_get_id(surface));
+            return;
+          }
+          surface_ref(surface)->subsurface = true;
+
+          wl_resource *subsurface = wl_resource_create(client, &wl_subsurface_interface, 1, id);
+          wl_resource_set_implementation(subsurface, &s_subsurfaceImpl, new SurfaceRef(surface_ref(surface)),
+                                         [](wl_resource *subsurface)
+                                         {
+                                           surface_ref(subsurface)->subsurface = false;
+                                           destroy_surface_ref(subsurface);
+                                         });
+        },
+    };
+
+    // wp_tearing_control_v1
+
+    const struct wp_tearing_control_v1_interface s_tearingControlImpl = {
+        .set_presentation_hint = [](wl_client *client, wl_resource *resource, uint32_t hint) {},
+        .destroy = destroy_resource,
+    };
+
+    const struct wp_tearing_control_manager_v1_interface s_tearingControlManagerImpl = {
+        .destroy = destroy_resource,
+        .get_tearing_control = [](wl_client *client, wl_resource *resource, uint32_t id, wl_resource *surface)
+        {
+          if (surface_ref(surface)->tearingControl)
+          {
+            wl_resource_post_error(resource, WP_TEARING_CONTROL_MANAGER_V1_ERROR_TEARING_CONTROL_EXISTS, "wl_surface@%u already has a tearing control object", wl_resource_get_id(surface));
+            return;
+          }
+          surface_ref(surface)->tearingControl = true;
+
+          wl_resource *tearingControl = wl_resource_create(client, &wp_tearing_control_v1_interface, 1, id);
+          wl_resource_set_implementation(tearingControl, &s_tearingControlImpl, new SurfaceRef(surface_ref(surface)),
+                                         [](wl_resource *tearingControl)
+                                         {
+                                           surface_ref(tearingControl)->tearingControl = false;
+                                           destroy_surface_ref(tearingControl);
+                                         });
+        },
+    };
+
+    // wp_content_type_v1
+
+    const struct wp_content_type_v1_interface s_contentTypeImpl = {
+        .destroy = destroy_resource,
+        .set_content_type = [](wl_client *client, wl_resource *resource, uint32_t contentType) {},
+    };
+
+    const struct wp_content_type_manager_v1_interface s_contentTypeManagerImpl = {
+        .destroy = destroy_resource,
+        .get_surface_content_type = [](wl_client *client, wl_resource *resource, uint32_t id, wl_resource *surface)
+        {
+          if (surface_ref(surface)->contentType)
+          {
+            wl_resource_post_error(resource, WP_CONTENT_TYPE_MANAGER_V1_ERROR_ALREADY_CONSTRUCTED, "wl_surface@%u already has a content type object", wl_resource_get_id(surface));
+            return;
+          }
+          surface_ref(surface)->contentType = true;
+
+          wl_resource *contentType = wl_resource_create(client, &wp_content_type_v1_interface, 1, id);
+          wl_resource_set_implementation(contentType, &s_contentTypeImpl, new SurfaceRef(surface_ref(surface)),
+                                         [](wl_resource *contentType)
+                                         {
+                                           surface_ref(contentType)->contentType = false;
+                                           destroy_surface_ref(contentType);
+                                         });
+        },
+    };
+
+    // wp_color_representation_v1
+
+    const struct wp_color_representation_v1_interface s_colorRepresentationImpl = {
+        .destroy = destroy_resource,
+        .set_alpha_mode = [](wl_client *client, wl_resource *resource, uint32_t alphaMode) {},
+        .set_coefficients = [](wl_client *client, wl_resource *resource, uint32_t codePoint) {},
+        .set_chroma_location = [](wl_client *client, wl_resource *resource, uint32_t codePoint) {},
+    };
+
+    const struct wp_color_representation_manager_v1_interface s_colorRepresentationManagerImpl = {
+        .destroy = destroy_resource,
+        .create = [](wl_client *client, wl_resource *resource, uint32_t id, wl_resource *surface)
+        {
+          if (surface_ref(surface)->colorRepresentation)
+          {
+            wl_resource_post_error(resource, WP_COLOR_REPRESENTATION_MANAGER_V1_ERROR_ALREADY_CONSTRUCTED, "wl_surface@%u already has a color representation object", wl_resource_get_id(surface));
+            return;
+          }
+          surface_ref(surface)->colorRepresentation = true;
+
+          wl_resource *colorRepresentation = wl_resource_create(client, &wp_color_representation_v1_interface, 1, id);
+          wl_resource_set_implementation(colorRepresentation, &s_colorRepresentationImpl, new SurfaceRef(surface_ref(surface)),
+                                         [](wl_resource *colorRepresentation)
+                                         {
+                                           surface_ref(colorRepresentation)->colorRepresentation = false;
+                                           destroy_surface_ref(colorRepresentation);
+                                         });
+        },
+    };
+
+    // wp_color_manager_v1
+
+    struct DescriptionState
+    {
+      // Only descriptions from the compositor (preferred, output) allow get_information
+      bool information;
+      uint32_t primaries;
+      uint32_t tf;
+    };
+
+    const struct wp_image_description_v1_interface s_imageDescriptionImpl = {
+        .destroy = destroy_resource,
+        .get_information = [](wl_client *client, wl_resource *resource)
+        {
+          auto state = static_cast<DescriptionState *>(wl_resource_get_user_data(resource));
+          if (!state->information)
+          {
+            wl_resource_post_error(resource, WP_IMAGE_DESCRIPTION_V1_ERROR_NO_INFORMATION, "get_information on a client created image description");
+            return;
+          }
+          wp_image_description_v1_send_primaries_cicp(resource, state->primaries);
+          wp_image_description_v1_send_tf_cicp(resource, state->tf);
+          wp_image_description_v1_send_done(resource);
+        },
+    };
+
+    wl_resource *create_description(wl_client *client, uint32_t id, Impl *impl, DescriptionState state)
+    {
+      wl_resource *description = wl_resource_create(client, &wp_image_description_v1_interface, 1, id);
+      wl_resource_set_implementation(description, &s_imageDescriptionImpl, new DescriptionState(state),
+                                     [](wl_resource *description)
+                                     { delete static_cast<DescriptionState *>(wl_resource_get_user_data(description)); });
+
+      if (contains(s_SupportedPrimaries, state.primaries) && contains(s_SupportedTf, state.tf))
+        wp_image_description_v1_send_ready(description, impl->nextIdentity++);
+      else
+        wp_image_description_v1_send_failed(description, WP_IMAGE_DESCRIPTION_V1_CAUSE_UNSUPPORTED, "unsupported primaries or transfer function");
+      return description;
+    }
+
+    void create_preferred(wl_client *client, wl_resource *resource, uint32_t id)
+    {
+      auto impl = static_cast<Impl *>(wl_resource_get_user_data(resource));
+      create_description(client, id, impl, DescriptionState{
+                                               .information = true,
+                                               .primaries = impl->config.preferredPrimaries,
+                                               .tf = impl->config.preferredTf,
+                                           });
+    }
+
+    struct ParamsState
+    {
+      Impl *impl;
+      std::optional<uint32_t> tf;
+      std::optional<uint32_t> primaries;
+      // mastering luminance, max_cll or max_fall, which are only allowed with PQ
+      bool pqOnly;
+      bool used;
+    };
+
+    ParamsState &params_state(wl_resource *resource)
+    {
+      return *static_cast<ParamsState *>(wl_resource_get_user_data(resource));
+    }
+
+    const struct wp_image_description_creator_params_v1_interface s_paramsImpl = {
+        .destroy = destroy_resource,
+        .create = [](wl_client *client, wl_resource *resource, uint32_t id)
+        {
+          ParamsState &params = params_state(resource);
+          if (params.used)
+          {
+            wl_resource_post_error(resource, WP_IMAGE_DESCRIPTION_CREATOR_PARAMS_V1_ERROR_ALREADY_USED, "create already sent");
+            return;
+          }
+          if (!params.tf || !params.primaries)
+          {
+            wl_resource_post_error(resource, WP_IMAGE_DESCRIPTION_CREATOR_PARAMS_V1_ERROR_INCOMPLETE_SET, "transfer function or primaries missing");
+            return;
+          }
+          if (params.pqOnly && *params.tf != 16)
+          {
+            wl_resource_post_error(resource, WP_IMAGE_DESCRIPTION_CREATOR_PARAMS_V1_ERROR_INCONSISTENT_SET, "mastering luminance, max_cll and max_fall require PQ");
+            return;
+          }
+          params.used = true;
+          create_description(client, id, params.impl, DescriptionState{
+                                                          .information = false,
+                                                          .primaries = *params.primaries,
+                                                          .tf = *params.tf,
+                                                      });
+        },
+        .set_tf_cicp = [](wl_client *client, wl_resource *resource, uint32_t tf)
+        {
+          ParamsState &params = params_state(resource);
+          if (params.tf)
+          {
+            wl_resource_post_error(resource, WP_IMAGE_DESCRIPTION_CREATOR_PARAMS_V1_ERROR_ALREADY_SET, "transfer function already set");
+            return;
+          }
+          params.tf = tf;
+        },
+        .set_tf_power = [](wl_client *client, wl_resource *resource, uint32_t eexp)
+        {
+          wl_resource_post_error(resource, WP_IMAGE_DESCRIPTION_CREATOR_PARAMS_V1_ERROR_INVALID_TF, "set_tf_power is not advertised");
+        },
+        .set_primaries_cicp = [](wl_client *client, wl_resource *resource, uint32_t primaries)
+        {
+          ParamsState &params = params_state(resource);
+          if (params.primaries)
+          {
+            wl_resource_post_error(resource, WP_IMAGE_DESCRIPTION_CREATOR_PARAMS_V1_ERROR_ALREADY_SET, "primaries already set");
+            return;
+          }
+          params.primaries = primaries;
+        },
+        .set_primaries = [](wl_client *client, wl_resource *resource,
+                            uint32_t r_x, uint32_t r_y, uint32_t g_x, uint32_t g_y, uint32_t b_x, uint32_t b_y, uint32_t w_x, uint32_t w_y)
+        {
+          ParamsState &params = params_state(resource);
+          if (params.primaries)
+          {
+            wl_resource_post_error(resource, WP_IMAGE_DESCRIPTION_CREATOR_PARAMS_V1_ERROR_ALREADY_SET, "primaries already set");
+            return;
+          }
+          params.primaries = 0; // custom, never matches a supported cicp
+        },
+        .set_mastering_display_primaries = [](wl_client *client, wl_resource *resource,
+                                              uint32_t r_x, uint32_t r_y, uint32_t g_x, uint32_t g_y, uint32_t b_x, uint32_t b_y, uint32_t w_x, uint32_t w_y) {},
+        .set_mastering_luminance = [](wl_client *client, wl_resource *resource, uint32_t minLum, uint32_t maxLum)
+        {
+          if (uint64_t(maxLum) * 10000 <= minLum)
+          {
+            wl_resource_post_error(resource, WP_IMAGE_DESCRIPTION_CREATOR_PARAMS_V1_ERROR_INVALID_LUMINANCE, "max luminance not above min luminance");
+            return;
+          }
+          params_state(resource).pqOnly = true;
+        },
+        .set_max_cll = [](wl_client *client, wl_resource *resource, uint32_t maxCll)
+        {
+          params_state(resource).pqOnly = true;
+        },
+        .set_max_fall = [](wl_client *client, wl_resource *resource, uint32_t maxFall)
+        {
+          params_state(resource).pqOnly = true;
+        },
+    };
+
+    const struct wp_image_description_creator_icc_v1_interface s_iccImpl = {
+        .destroy = destroy_resource,
+        .create = [](wl_client *client, wl_resource *resource, uint32_t id)
+        {
+          wl_resource *description = wl_resource_create(client, &wp_image_description_v1_interface, 1, id);
+          wl_resource_set_implementation(description, &s_imageDescriptionImpl, new DescriptionState{}, [](wl_resource *description)
+                                         { delete static_cast<DescriptionState *>(wl_resource_get_user_data(description)); });
+          wp_image_description_v1_send_failed(description, WP_IMAGE_DESCRIPTION_V1_CAUSE_UNSUPPORTED, "ICC profiles are not advertised");
+        },
+        .set_icc_file = [](wl_client *client, wl_resource *resource, int32_t fd, uint32_t offset, uint32_t length)
+        {
+          close(fd);
+        },
+    };
+
+    const struct wp_color_management_surface_v1_interface s_colorSurfaceImpl = {
+        .destroy = destroy_resource,
+        .set_image_description = [](wl_client *client, wl_resource *resource, wl_resource *description, uint32_t renderIntent) {},
+        .set_default_image_description = [](wl_client *client, wl_resource *resource) {},
+        .get_preferred = create_preferred,
+    };
+
+    const struct wp_color_management_output_v1_interface s_colorOutputImpl = {
+        .destroy = destroy_resource,
+        .get_image_description = create_preferred,
+    };
+
+    const struct wp_color_manager_v1_interface s_colorManagerImpl = {
+        .destroy = destroy_resource,
+        .get_color_management_output = [](wl_client *client, wl_resource *resource, uint32_t id, wl_resource *output)
+        {
+          wl_resource *colorOutput = wl_resource_create(client, &wp_color_management_output_v1_interface, 1, id);
+          wl_resource_set_implementation(colorOutput, &s_colorOutputImpl, wl_resource_get_user_data(resource), nullptr);
+        },
+        .get_color_management_surface = [](wl_client *client, wl_resource *resource, uint32_t id, wl_resource *surface)
+        {
+          auto impl = static_cast<Impl *>(wl_resource_get_user_data(resource));
+          wl_resource *colorSurface = wl_resource_create(client, &wp_color_management_surface_v1_interface, 1, id);
+          wl_resource_set_implementation(colorSurface, &s_colorSurfaceImpl, impl,
+                                         [](wl_resource *colorSurface)
+                                         {
+                                           auto impl = static_cast<Impl *>(wl_resource_get_user_data(colorSurface));
+                                           std::erase(impl->colorSurfaces, colorSurface);
+                                         });
+          impl->colorSurfaces.push_back(colorSurface);
+        },
+        .new_icc_creator = [](wl_client *client, wl_resource *resource, uint32_t id)
+        {
+          wl_resource *creator = wl_resource_create(client, &wp_image_description_creator_icc_v1_interface, 1, id);
+          wl_resource_set_implementation(creator, &s_iccImpl, nullptr, nullptr);
+        },
+        .new_parametric_creator = [](wl_client *client, wl_resource *resource, uint32_t id)
+        {
+          wl_resource *creator = wl_resource_create(client, &wp_image_description_creator_params_v1_interface, 1, id);
+          wl_resource_set_implementation(creator, &s_paramsImpl,
+                                         new ParamsState{
+                                             .impl = static_cast<Impl *>(wl_resource_get_user_data(resource)),
+                                             .tf = std::nullopt,
+                                             .primaries = std::nullopt,
+                                             .pqOnly = false,
+                                             .used = false,
+                                         },
+                                         [](wl_resource *creator)
+                                         { delete &params_state(creator); });
+        },
+    };
+
+    // Globals
+
+    template <const wl_interface *Interface, auto Implementation>
+    void bind_global(wl_client *client, void *data, uint32_t version, uint32_t id)
+    {
+      wl_resource *resource = wl_resource_create(client, Interface, int(version), id);
+      wl_resource_set_implementation(resource, Implementation, data, nullptr);
+    }
+
+    void bind_color_manager(wl_client *client, void *data, uint32_t version, uint32_t id)
+    {
+      wl_resource *resource = wl_resource_create(client, &wp_color_manager_v1_interface, int(version), id);
+      wl_resource_set_implementation(resource, &s_colorManagerImpl, data, nullptr);
+
+      wp_color_manager_v1_send_supported_intent(resource, WP_COLOR_MANAGER_V1_RENDER_INTENT_PERCEPTUAL);
+      for (uint32_t feature : {WP_COLOR_MANAGER_V1_FEATURE_PARAMETRIC,
+                               WP_COLOR_MANAGER_V1_FEATURE_SET_PRIMARIES,
+                               WP_COLOR_MANAGER_V1_FEATURE_SET_MASTERING_DISPLAY_PRIMARIES,
+                               WP_COLOR_MANAGER_V1_FEATURE_EXTENDED_TARGET_VOLUME})
+        wp_color_manager_v1_send_supported_feature(resource, feature);
+      for (uint32_t tf : s_SupportedTf)
+        wp_color_manager_v1_send_supported_tf_cicp(resource, tf);
+      for (uint32_t primaries : s_SupportedPrimaries)
+        wp_color_manager_v1_send_supported_primaries_cicp(resource, primaries);
+    }
+
+    int run_work(int fd, uint32_t mask, void *data)
+    {
+      auto impl = static_cast<Impl *>(data);
+      uint64_t value;
+      if (read(fd, &value, sizeof(value)) != sizeof(value))
+        return 0;
+
+      std::vector<std::function<void()>> work;
+      {
+        std::lock_guard lock(impl->mutex);
+        work.swap(impl->work);
+      }
+      for (auto &fn : work)
+        fn();
+      return 0;
+    }
+  }
+
+  void MockCompositor::Impl::run(std::function<void()> fn)
+  {
+    std::promise<void> done;
+    {
+      std::lock_guard lock(mutex);
+      work.push_back([&]()
+                     {
+                       fn();
+                       wl_display_flush_clients(display);
+                       done.set_value();
+                     });
+    }
+    uint64_t value = 1;
+    if (write(wakeFd, &value, sizeof(value)) != sizeof(value))
+    {
+      perror("write");
+      abort();
+    }
+    done.get_future().wait();
+  }
+
+  MockCompositor::MockCompositor(const MockCompositorConfig &config)
+      : m_impl(std::make_unique<Impl>())
+  {
+    Impl *impl = m_impl.get();
+    impl->config = config;
+    impl->display = wl_display_create();
+    impl->logger = wl_display_add_protocol_logger(impl->display, log_request, impl);
+    impl->nextIdentity = 1;
+    impl->colorManager = nullptr;
+    impl->wakeFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (impl->wakeFd < 0)
+    {
+      perror("eventfd");
+      abort();
+    }
+    impl->wakeSource = wl_event_loop_add_fd(wl_display_get_event_loop(impl->display), impl->wakeFd, WL_EVENT_READABLE, run_work, impl);
+
+    wl_global_create(impl->display, &wl_compositor_interface, 4, impl, bind_global<&wl_compositor_interface, &s_compositorImpl>);
+    if (config.subcompositor)
+      wl_global_create(impl->display, &wl_subcompositor_interface, 1, impl, bind_global<&wl_subcompositor_interface, &s_subcompositorImpl>);
+    if (config.colorManagement)
+      impl->colorManager = wl_global_create(impl->display, &wp_color_manager_v1_interface, 1, impl, bind_color_manager);
+    if (config.colorRepresentation)
+      wl_global_create(impl->display, &wp_color_representation_manager_v1_interface, 1, impl, bind_global<&wp_color_representation_manager_v1_interface, &s_colorRepresentationManagerImpl>);
+    if (config.tearingControl)
+      wl_global_create(impl->display, &wp_tearing_control_manager_v1_interface, 1, impl, bind_global<&wp_tearing_control_manager_v1_interface, &s_tearingControlManagerImpl>);
+    if (config.contentType)
+      wl_global_create(impl->display, &wp_content_type_manager_v1_interface, 1, impl, bind_global<&wp_content_type_manager_v1_interface, &s_contentTypeManagerImpl>);
+
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0)
+    {
+      perror("socketpair");
+      abort();
+    }
+    wl_client_create(impl->display, fds[0]);
+    impl->clientFd = fds[1];
+
+    impl->thread = std::thread(wl_display_run, impl->display);
+  }
+
+  MockCompositor::~MockCompositor()
+  {
+    wl_display_terminate(m_impl->display);
+    m_impl->thread.join();
+
+    if (m_impl->clientFd >= 0)
+      close(m_impl->clientFd);
+    wl_event_source_remove(m_impl->wakeSource);
+    close(m_impl->wakeFd);
+    wl_protocol_logger_destroy(m_impl->logger);
+    wl_display_destroy_clients(m_impl->display);
+    wl_display_destroy(m_impl->display);
+  }
+
+  int MockCompositor::takeClientFd()
+  {
+    int fd = m_impl->clientFd;
+    m_impl->clientFd = -1;
+    return fd;
+  }
+
+  std::vector<MockRequest> MockCompositor::requests() const
+  {
+    std::lock_guard lock(m_impl->mutex);
+    return m_impl->requests;
+  }
+
+  size_t MockCompositor::count(std::string_view name, uint32_t object) const
+  {
+    std::lock_guard lock(m_impl->mutex);
+    if (!object)
+    {
+      auto it = m_impl->counts.find(name);
+      return it != m_impl->counts.end() ? it->second : 0;
+    }
+    return size_t(std::count_if(m_impl->requests.begin(), m_impl->requests.end(),
+                                [=](const MockRequest &request)
+                                { return request.name == name && (!object || request.object == object); }));
+  }
+
+  ptrdiff_t MockCompositor::find(std::string_view name, uint32_t object) const
+  {
+    std::lock_guard lock(m_impl->mutex);
+    auto request = std::find_if(m_impl->requests.begin(), m_impl->requests.end(),
+                                [=](const MockRequest &request)
+                                { return request.name == name && (!object || request.object == object); });
+    return request != m_impl->requests.end() ? request - m_impl->requests.begin() : -1;
+  }
+
+  std::optional<MockRequest> MockCompositor::last(std::string_view name, uint32_t object) const
+  {
+    std::lock_guard lock(m_impl->mutex);
+    auto request = std::find_if(m_impl->requests.rbegin(), m_impl->requests.rend(),
+                                [=](const MockRequest &request)
+                                { return request.name == name && (!object || request.object == object); });
+    if (request == m_impl->requests.rend())
+      return std::nullopt;
+    return *request;
+  }
+
+  void MockCompositor::setPreferred(uint32_t primaries, uint32_t tf)
+  {
+    Impl *impl = m_impl.get();
+    impl->run([=]()
+              {
+                impl->config.preferredPrimaries = primaries;
+                impl->config.preferredTf = tf;
+                for (wl_resource *colorSurface : impl->colorSurfaces)
+                  wp_color_management_surface_v1_send_preferred_changed(colorSurface);
+              });
+  }
+
+  void MockCompositor::removeColorManager()
+  {
+    Impl *impl = m_impl.get();
+    impl->run([=]()
+              {
+                // Destroyed with the display, a client may still be binding it
+                if (impl->colorManager)
+                  wl_global_remove(impl->colorManager);
+                impl->colorManager = nullptr;
+              });
+  }
+
+  void MockCompositor::addColorManager()
+  {
+    Impl *impl = m_impl.get();
+    impl->run([=]()
+              {
+                if (!impl->colorManager)
+                  impl->colorManager = wl_global_create(impl->display, &wp_color_manager_v1_interface, 1, impl, bind_color_manager);
+              });
+  }
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace HdrLayerTest
+{
+  // Globals and capabilities the mock compositor advertises.
+  struct MockCompositorConfig
+  {
+    bool subcompositor = true;
+    bool colorManagement = true;
+    bool colorRepresentation = true;
+    bool tearingControl = true;
+    bool contentType = true;
+    // Sent for every preferred image description
+    uint32_t preferredPrimaries = 9;
+    uint32_t preferredTf = 16;
+  };
+
+  // A request as the compositor received it: "interface.request", the id of
+  // the object it was sent to and its integer, object id and new_id arguments
+  // in order (0 for anything else).
+  struct MockRequest
+  {
+    std::string name;
+    uint32_t object;
+    std::vector<uint32_t> args;
+  };
+
+  // In-process wayland-server running on its own thread, with just enough of
+  // wl_compositor, wl_subcompositor and the protocols the layer uses to follow
+  // their rules (including raising their protocol errors). Every request is
+  // logged. Requests show up once the compositor handled them, so roundtrip
+  // the client connection before looking.
+  class MockCompositor
+  {
+  public:
+    explicit MockCompositor(const MockCompositorConfig &config = {});
+    ~MockCompositor();
+
+    MockCompositor(const MockCompositor &) = delete;
+    MockCompositor &operator=(const MockCompositor &) = delete;
+
+    // The client end of the connection, for wl_display_connect_to_fd
+    int takeClientFd();
+
+    std::vector<MockRequest> requests() const;
+    // object 0 matches any object
+    size_t count(std::string_view name, uint32_t object = 0) const;
+    // Position of the first matching request in the log, -1 if none
+    ptrdiff_t find(std::string_view name, uint32_t object = 0) const;
+    std::optional<MockRequest> last(std::string_view name, uint32_t object = 0) const;
+
+    // Runtime changes, applied on the compositor thread before returning.
+    // Roundtrip the client connection to have them reach the layer.
+
+    // Changes the preferred image description and sends preferred_changed
+    // for every color managed surface, like moving them to another output.
+    void setPreferred(uint32_t primaries, uint32_t tf);
+    // Removes the wp_color_manager_v1 global, objects bound from it keep working.
+    void removeColorManager();
+    // Announces a new wp_color_manager_v1 global, like a restarted color pipeline.
+    void addColorManager();
+
+    struct Impl;
+
+  private:
+    std::unique_ptr<Impl> m_impl;
+  };
+}
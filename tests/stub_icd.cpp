@@ -0,0 +1,408 @@
+// Minimal Vulkan ICD for the layer tests and benchmarks.
+//
+// One physical device, Wayland surfaces and swapchains with no-op images.
+// Presents commit the wl_surface like a real driver would, so the compositor
+// sees the commit that latches whatever the layer sent before it.
+#define VK_USE_PLATFORM_WAYLAND_KHR
+#include "stub_icd.h"
+
+#include <vulkan/vk_icd.h>
+#include <wayland-client.h>
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <string_view>
+#include <vector>
+
+using namespace std::literals;
+
+namespace
+{
+  struct StubPhysicalDevice
+  {
+    VK_LOADER_DATA loaderData;
+  };
+
+  struct StubInstance
+  {
+    VK_LOADER_DATA loaderData;
+    StubPhysicalDevice physicalDevice;
+  };
+
+  struct StubQueue
+  {
+    VK_LOADER_DATA loaderData;
+  };
+
+  struct StubDevice
+  {
+    VK_LOADER_DATA loaderData;
+    StubQueue queue;
+  };
+
+  struct StubSurface
+  {
+    wl_display *display;
+    wl_surface *surface;
+    uint32_t id;
+  };
+
+  struct StubSwapchain
+  {
+    StubSurface *surface;
+    uint32_t imageCount;
+    uint32_t nextImage;
+    std::array<uint8_t, 8> images; // addresses used as VkImage handles
+  };
+
+  StubIcdHooks s_hooks = {};
+
+  template <typename T, size_t N>
+  VkResult fill(const std::array<T, N> &values, uint32_t *pCount, T *pValues)
+  {
+    if (!pValues)
+    {
+      *pCount = uint32_t(N);
+      return VK_SUCCESS;
+    }
+    uint32_t count = std::min(*pCount, uint32_t(N));
+    std::copy_n(values.begin(), count, pValues);
+    *pCount = count;
+    return count < N ? VK_INCOMPLETE : VK_SUCCESS;
+  }
+
+  VkExtensionProperties extension(const char *name, uint32_t specVersion)
+  {
+    VkExtensionProperties props = {};
+    strncpy(props.extensionName, name, VK_MAX_EXTENSION_NAME_SIZE - 1);
+    props.specVersion = specVersion;
+    return props;
+  }
+
+  VKAPI_ATTR VkResult VKAPI_CALL CreateInstance(const VkInstanceCreateInfo *pCreateInfo, const VkAllocationCallbacks *pAllocator, VkInstance *pInstance)
+  {
+    auto instance = new StubInstance{};
+    instance->loaderData.loaderMagic = ICD_LOADER_MAGIC;
+    instance->physicalDevice.loaderData.loaderMagic = ICD_LOADER_MAGIC;
+    *pInstance = reinterpret_cast<VkInstance>(instance);
+    return VK_SUCCESS;
+  }
+
+  VKAPI_ATTR void VKAPI_CALL DestroyInstance(VkInstance instance, const VkAllocationCallbacks *pAllocator)
+  {
+    delete reinterpret_cast<StubInstance *>(instance);
+  }
+
+  VKAPI_ATTR VkResult VKAPI_CALL EnumerateInstanceExtensionProperties(const char *pLayerName, uint32_t *pPropertyCount, VkExtensionProperties *pProperties)
+  {
+    const std::array<VkExtensionProperties, 2> extensions = {
+        extension(VK_KHR_SURFACE_EXTENSION_NAME, VK_KHR_SURFACE_SPEC_VERSION),
+        extension(VK_KHR_WAYLAND_SURFACE_EXTENSION_NAME, VK_KHR_WAYLAND_SURFACE_SPEC_VERSION),
+    };
+    return fill(extensions, pPropertyCount, pProperties);
+  }
+
+  VKAPI_ATTR VkResult VKAPI_CALL EnumerateInstanceVersion(uint32_t *pApiVersion)
+  {
+    *pApiVersion = VK_API_VERSION_1_3;
+    return VK_SUCCESS;
+  }
+
+  VKAPI_ATTR VkResult VKAPI_CALL EnumeratePhysicalDevices(VkInstance instance, uint32_t *pPhysicalDeviceCount, VkPhysicalDevice *pPhysicalDevices)
+  {
+    const std::array<VkPhysicalDevice, 1> physicalDevices = {
+        reinterpret_cast<VkPhysicalDevice>(&reinterpret_cast<StubInstance *>(instance)->physicalDevice),
+    };
+    return fill(physicalDevices, pPhysicalDeviceCount, pPhysicalDevices);
+  }
+
+  VKAPI_ATTR void VKAPI_CALL GetPhysicalDeviceProperties(VkPhysicalDevice physicalDevice, VkPhysicalDeviceProperties *pProperties)
+  {
+    *pProperties = {};
+    pProperties->apiVersion = VK_API_VERSION_1_3;
+    pProperties->driverVersion = 1;
+    pProperties->deviceType = VK_PHYSICAL_DEVICE_TYPE_CPU;
+    strncpy(pProperties->deviceName, "HDR WSI stub", VK_MAX_PHYSICAL_DEVICE_NAME_SIZE - 1);
+  }
+
+  VKAPI_ATTR void VKAPI_CALL GetPhysicalDeviceProperties2(VkPhysicalDevice physicalDevice, VkPhysicalDeviceProperties2 *pProperties)
+  {
+    GetPhysicalDeviceProperties(physicalDevice, &pProperties->properties);
+  }
+
+  VKAPI_ATTR void VKAPI_CALL GetPhysicalDeviceFeatures(VkPhysicalDevice physicalDevice, VkPhysicalDeviceFeatures *pFeatures)
+  {
+    *pFeatures = {};
+  }
+
+  VKAPI_ATTR void VKAPI_CALL GetPhysicalDeviceMemoryProperties(VkPhysicalDevice physicalDevice, VkPhysicalDeviceMemoryProperties *pMemoryProperties)
+  {
+    *pMemoryProperties = {};
+  }
+
+  VKAPI_ATTR void VKAPI_CALL GetPhysicalDeviceQueueFamilyProperties(VkPhysicalDevice physicalDevice, uint32_t *pQueueFamilyPropertyCount, VkQueueFamilyProperties *pQueueFamilyProperties)
+  {
+    const std::array<VkQueueFamilyProperties, 1> families = {
+        VkQueueFamilyProperties{
+            .queueFlags = VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT | VK_QUEUE_TRANSFER_BIT,
+            .queueCount = 1,
+            .timestampValidBits = 0,
+            .minImageTransferGranularity = {1, 1, 1},
+        },
+    };
+    fill(families, pQueueFamilyPropertyCount, pQueueFamilyProperties);
+  }
+
+  VKAPI_ATTR VkResult VKAPI_CALL EnumerateDeviceExtensionProperties(VkPhysicalDevice physicalDevice, const char *pLayerName, uint32_t *pPropertyCount, VkExtensionProperties *pProperties)
+  {
+    const std::array<VkExtensionProperties, 2> extensions = {
+        extension(VK_KHR_SWAPCHAIN_EXTENSION_NAME, VK_KHR_SWAPCHAIN_SPEC_VERSION),
+        extension(VK_EXT_HDR_METADATA_EXTENSION_NAME, VK_EXT_HDR_METADATA_SPEC_VERSION),
+    };
+    return fill(extensions, pPropertyCount, pProperties);
+  }
+
+  VKAPI_ATTR VkResult VKAPI_CALL CreateDevice(VkPhysicalDevice physicalDevice, const VkDeviceCreateInfo *pCreateInfo, const VkAllocationCallbacks *pAllocator, VkDevice *pDevice)
+  {
+    auto device = new StubDevice{};
+    device->loaderData.loaderMagic = ICD_LOADER_MAGIC;
+    device->queue.loaderData.loaderMagic = ICD_LOADER_MAGIC;
+    *pDevice = reinterpret_cast<VkDevice>(device);
+    return VK_SUCCESS;
+  }
+
+  VKAPI_ATTR void VKAPI_CALL DestroyDevice(VkDevice device, const VkAllocationCallbacks *pAllocator)
+  {
+    delete reinterpret_cast<StubDevice *>(device);
+  }
+
+  VKAPI_ATTR void VKAPI_CALL GetDeviceQueue(VkDevice device, uint32_t queueFamilyIndex, uint32_t queueIndex, VkQueue *pQueue)
+  {
+    *pQueue = reinterpret_cast<VkQueue>(&reinterpret_cast<StubDevice *>(device)->queue);
+  }
+
+  VKAPI_ATTR VkResult VKAPI_CALL DeviceWaitIdle(VkDevice device)
+  {
+    return VK_SUCCESS;
+  }
+
+  VKAPI_ATTR VkResult VKAPI_CALL CreateWaylandSurfaceKHR(VkInstance instance, const VkWaylandSurfaceCreateInfoKHR *pCreateInfo, const VkAllocationCallbacks *pAllocator, VkSurfaceKHR *pSurface)
+  {
+    auto surface = new StubSurface{
+        .display = pCreateInfo->display,
+        .surface = pCreateInfo->surface,
+        .id = wl_proxy_get_id(reinterpret_cast<wl_proxy *>(pCreateInfo->surface)),
+    };
+
+    std::vector<VkStructureType> pNextTypes;
+    for (auto next = reinterpret_cast<const VkBaseInStructure *>(pCreateInfo->pNext); next; next = next->pNext)
+      pNextTypes.push_back(next->sType);
+    if (s_hooks.surfaceCreated)
+      s_hooks.surfaceCreated(s_hooks.user, surface->id, pNextTypes.data(), uint32_t(pNextTypes.size()));
+
+    *pSurface = reinterpret_cast<VkSurfaceKHR>(surface);
+    return VK_SUCCESS;
+  }
+
+  VKAPI_ATTR void VKAPI_CALL DestroySurfaceKHR(VkInstance instance, VkSurfaceKHR surface, const VkAllocationCallbacks *pAllocator)
+  {
+    auto stubSurface = reinterpret_cast<StubSurface *>(surface);
+    if (!stubSurface)
+      return;
+    if (s_hooks.surfaceDestroyed)
+      s_hooks.surfaceDestroyed(s_hooks.user, stubSurface->id);
+    delete stubSurface;
+  }
+
+  VKAPI_ATTR VkBool32 VKAPI_CALL GetPhysicalDeviceWaylandPresentationSupportKHR(VkPhysicalDevice physicalDevice, uint32_t queueFamilyIndex, wl_display *display)
+  {
+    return VK_TRUE;
+  }
+
+  VKAPI_ATTR VkResult VKAPI_CALL GetPhysicalDeviceSurfaceSupportKHR(VkPhysicalDevice physicalDevice, uint32_t queueFamilyIndex, VkSurfaceKHR surface, VkBool32 *pSupported)
+  {
+    *pSupported = VK_TRUE;
+    return VK_SUCCESS;
+  }
+
+  VKAPI_ATTR VkResult VKAPI_CALL GetPhysicalDeviceSurfaceCapabilitiesKHR(VkPhysicalDevice physicalDevice, VkSurfaceKHR surface, VkSurfaceCapabilitiesKHR *pSurfaceCapabilities)
+  {
+    *pSurfaceCapabilities = VkSurfaceCapabilitiesKHR{
+        .minImageCount = 2,
+        .maxImageCount = 8,
+        .currentExtent = {0xFFFFFFFF, 0xFFFFFFFF},
+        .minImageExtent = {1, 1},
+        .maxImageExtent = {16384, 16384},
+        .maxImageArrayLayers = 1,
+        .supportedTransforms = VK_SURFACE_TRANSFORM_IDENTITY_BIT_KHR,
+        .currentTransform = VK_SURFACE_TRANSFORM_IDENTITY_BIT_KHR,
+        .supportedCompositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR | VK_COMPOSITE_ALPHA_PRE_MULTIPLIED_BIT_KHR | VK_COMPOSITE_ALPHA_POST_MULTIPLIED_BIT_KHR,
+        .supportedUsageFlags = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT,
+    };
+    return VK_SUCCESS;
+  }
+
+  VKAPI_ATTR VkResult VKAPI_CALL GetPhysicalDeviceSurfaceFormatsKHR(VkPhysicalDevice physicalDevice, VkSurfaceKHR surface, uint32_t *pSurfaceFormatCount, VkSurfaceFormatKHR *pSurfaceFormats)
+  {
+    const std::array<VkSurfaceFormatKHR, 5> formats = {{
+        {VK_FORMAT_B8G8R8A8_UNORM, VK_COLOR_SPACE_SRGB_NONLINEAR_KHR},
+        {VK_FORMAT_B8G8R8A8_SRGB, VK_COLOR_SPACE_SRGB_NONLINEAR_KHR},
+        {VK_FORMAT_A2B10G10R10_UNORM_PACK32, VK_COLOR_SPACE_SRGB_NONLINEAR_KHR},
+        {VK_FORMAT_A2R10G10B10_UNORM_PACK32, VK_COLOR_SPACE_SRGB_NONLINEAR_KHR},
+        {VK_FORMAT_R16G16B16A16_SFLOAT, VK_COLOR_SPACE_SRGB_NONLINEAR_KHR},
+    }};
+    return fill(formats, pSurfaceFormatCount, pSurfaceFormats);
+  }
+
+  VKAPI_ATTR VkResult VKAPI_CALL GetPhysicalDeviceSurfacePresentModesKHR(VkPhysicalDevice physicalDevice, VkSurfaceKHR surface, uint32_t *pPresentModeCount, VkPresentModeKHR *pPresentModes)
+  {
+    const std::array<VkPresentModeKHR, 3> presentModes = {
+        VK_PRESENT_MODE_FIFO_KHR,
+        VK_PRESENT_MODE_MAILBOX_KHR,
+        VK_PRESENT_MODE_IMMEDIATE_KHR,
+    };
+    return fill(presentModes, pPresentModeCount, pPresentModes);
+  }
+
+  VKAPI_ATTR VkResult VKAPI_CALL CreateSwapchainKHR(VkDevice device, const VkSwapchainCreateInfoKHR *pCreateInfo, const VkAllocationCallbacks *pAllocator, VkSwapchainKHR *pSwapchain)
+  {
+    auto swapchain = new StubSwapchain{
+        .surface = reinterpret_cast<StubSurface *>(pCreateInfo->surface),
+        .imageCount = std::clamp(pCreateInfo->minImageCount, 2u, 8u),
+        .nextImage = 0,
+        .images = {},
+    };
+    *pSwapchain = reinterpret_cast<VkSwapchainKHR>(swapchain);
+    return VK_SUCCESS;
+  }
+
+  VKAPI_ATTR void VKAPI_CALL DestroySwapchainKHR(VkDevice device, VkSwapchainKHR swapchain, const VkAllocationCallbacks *pAllocator)
+  {
+    delete reinterpret_cast<StubSwapchain *>(swapchain);
+  }
+
+  VKAPI_ATTR VkResult VKAPI_CALL GetSwapchainImagesKHR(VkDevice device, VkSwapchainKHR swapchain, uint32_t *pSwapchainImageCount, VkImage *pSwapchainImages)
+  {
+    auto stubSwapchain = reinterpret_cast<StubSwapchain *>(swapchain);
+    if (!pSwapchainImages)
+    {
+      *pSwapchainImageCount = stubSwapchain->imageCount;
+      return VK_SUCCESS;
+    }
+    uint32_t count = std::min(*pSwapchainImageCount, stubSwapchain->imageCount);
+    for (uint32_t i = 0; i < count; i++)
+      pSwapchainImages[i] = reinterpret_cast<VkImage>(&stubSwapchain->images[i]);
+    *pSwapchainImageCount = count;
+    return count < stubSwapchain->imageCount ? VK_INCOMPLETE : VK_SUCCESS;
+  }
+
+  VKAPI_ATTR VkResult VKAPI_CALL AcquireNextImageKHR(VkDevice device, VkSwapchainKHR swapchain, uint64_t timeout, VkSemaphore semaphore, VkFence fence, uint32_t *pImageIndex)
+  {
+    auto stubSwapchain = reinterpret_cast<StubSwapchain *>(swapchain);
+    *pImageIndex = stubSwapchain->nextImage;
+    stubSwapchain->nextImage = (stubSwapchain->nextImage + 1) % stubSwapchain->imageCount;
+    return VK_SUCCESS;
+  }
+
+  VKAPI_ATTR VkResult VKAPI_CALL QueuePresentKHR(VkQueue queue, const VkPresentInfoKHR *pPresentInfo)
+  {
+    for (uint32_t i = 0; i < pPresentInfo->swapchainCount; i++)
+    {
+      StubSurface *surface = reinterpret_cast<StubSwapchain *>(pPresentInfo->pSwapchains[i])->surface;
+      wl_surface_commit(surface->surface);
+      wl_display_flush(surface->display);
+      if (pPresentInfo->pResults)
+        pPresentInfo->pResults[i] = VK_SUCCESS;
+    }
+    return VK_SUCCESS;
+  }
+
+  VKAPI_ATTR void VKAPI_CALL SetHdrMetadataEXT(VkDevice device, uint32_t swapchainCount, const VkSwapchainKHR *pSwapchains, const VkHdrMetadataEXT *pMetadata)
+  {
+  }
+
+  struct Entrypoint
+  {
+    std::string_view name;
+    PFN_vkVoidFunction function;
+  };
+
+#define STUB_ENTRYPOINT(name) Entrypoint{"vk" #name, reinterpret_cast<PFN_vkVoidFunction>(&name)}
+
+  VKAPI_ATTR PFN_vkVoidFunction VKAPI_CALL GetDeviceProcAddr(VkDevice device, const char *pName);
+
+  const std::array s_instanceEntrypoints = {
+      STUB_ENTRYPOINT(CreateInstance),
+      STUB_ENTRYPOINT(DestroyInstance),
+      STUB_ENTRYPOINT(EnumerateInstanceExtensionProperties),
+      STUB_ENTRYPOINT(EnumerateInstanceVersion),
+      STUB_ENTRYPOINT(EnumeratePhysicalDevices),
+      STUB_ENTRYPOINT(GetPhysicalDeviceProperties),
+      STUB_ENTRYPOINT(GetPhysicalDeviceProperties2),
+      STUB_ENTRYPOINT(GetPhysicalDeviceFeatures),
+      STUB_ENTRYPOINT(GetPhysicalDeviceMemoryProperties),
+      STUB_ENTRYPOINT(GetPhysicalDeviceQueueFamilyProperties),
+      STUB_ENTRYPOINT(EnumerateDeviceExtensionProperties),
+      STUB_ENTRYPOINT(CreateDevice),
+      STUB_ENTRYPOINT(GetDeviceProcAddr),
+      STUB_ENTRYPOINT(CreateWaylandSurfaceKHR),
+      STUB_ENTRYPOINT(DestroySurfaceKHR),
+      STUB_ENTRYPOINT(GetPhysicalDeviceWaylandPresentationSupportKHR),
+      STUB_ENTRYPOINT(GetPhysicalDeviceSurfaceSupportKHR),
+      STUB_ENTRYPOINT(GetPhysicalDeviceSurfaceCapabilitiesKHR),
+      STUB_ENTRYPOINT(GetPhysicalDeviceSurfaceFormatsKHR),
+      STUB_ENTRYPOINT(GetPhysicalDeviceSurfacePresentModesKHR),
+  };
+
+  const std::array s_deviceEntrypoints = {
+      STUB_ENTRYPOINT(GetDeviceProcAddr),
+      STUB_ENTRYPOINT(DestroyDevice),
+      STUB_ENTRYPOINT(GetDeviceQueue),
+      STUB_ENTRYPOINT(DeviceWaitIdle),
+      STUB_ENTRYPOINT(CreateSwapchainKHR),
+      STUB_ENTRYPOINT(DestroySwapchainKHR),
+      STUB_ENTRYPOINT(GetSwapchainImagesKHR),
+      STUB_ENTRYPOINT(AcquireNextImageKHR),
+      STUB_ENTRYPOINT(QueuePresentKHR),
+      STUB_ENTRYPOINT(SetHdrMetadataEXT),
+  };
+
+#undef STUB_ENTRYPOINT
+
+  template <typename T>
+  PFN_vkVoidFunction lookup(const T &entrypoints, const char *pName)
+  {
+    auto entrypoint = std::find_if(entrypoints.begin(), entrypoints.end(),
+                                   [=](const Entrypoint &value)
+                                   { return value.name == pName; });
+    return entrypoint != entrypoints.end() ? entrypoint->function : nullptr;
+  }
+
+  VKAPI_ATTR PFN_vkVoidFunction VKAPI_CALL GetDeviceProcAddr(VkDevice device, const char *pName)
+  {
+    return lookup(s_deviceEntrypoints, pName);
+  }
+}
+
+extern "C"
+{
+  VKAPI_ATTR VkResult VKAPI_CALL vk_icdNegotiateLoaderICDInterfaceVersion(uint32_t *pSupportedVersion)
+  {
+    // 5: surfaces are created by the ICD, apiVersion is never rejected
+    *pSupportedVersion = std::min(*pSupportedVersion, 5u);
+    return VK_SUCCESS;
+  }
+
+  VKAPI_ATTR PFN_vkVoidFunction VKAPI_CALL vk_icdGetInstanceProcAddr(VkInstance instance, const char *pName)
+  {
+    if (auto function = lookup(s_instanceEntrypoints, pName))
+      return function;
+    return lookup(s_deviceEntrypoints, pName);
+  }
+
+  void stub_icd_set_hooks(const StubIcdHooks *pHooks)
+  {
+    s_hooks = pHooks ? *pHooks : StubIcdHooks{};
+  }
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+#include <cstdint>
+
+// Test-only entry point of the stub ICD (stub_icd.cpp), looked up with dlsym
+// on the ICD library the loader opened.
+struct StubIcdHooks
+{
+  void *user;
+  // vkCreateWaylandSurfaceKHR: id of the wl_surface the driver surface is
+  // created for and the sTypes the driver found in the pNext chain.
+  void (*surfaceCreated)(void *user, uint32_t wlSurfaceId, const VkStructureType *pNextTypes, uint32_t pNextCount);
+  // vkDestroySurfaceKHR, before the driver lets go of the wl_surface.
+  void (*surfaceDestroyed)(void *user, uint32_t wlSurfaceId);
+};
+
+extern "C" typedef void (*PFN_stub_icd_set_hooks)(const StubIcdHooks *pHooks);
@@ -0,0 +1,123 @@
+// Runtime changes of the compositor's color management state: a preferred
+// description that drops to SDR and comes back, and a color manager global
+// that goes away and is announced again.
+#include "harness.h"
+
+using namespace HdrLayerTest;
+
+static constexpr uint32_t s_PrimariesSrgb = 1;
+static constexpr uint32_t s_PrimariesBt2020 = 9;
+static constexpr uint32_t s_TfSrgb = 13;
+static constexpr uint32_t s_TfPq = 16;
+
+// Each present picks up whatever arrived by then and answers it, the
+// roundtrip before it makes sure the compositor handled the last answers.
+static VkResult settle(Harness &harness, const std::vector<VkSwapchainKHR> &swapchains, std::vector<VkResult> &results)
+{
+  VkResult result = VK_SUCCESS;
+  for (int i = 0; i < 5; i++)
+  {
+    harness.roundtrip();
+    result = harness.present(swapchains, results);
+  }
+  return result;
+}
+
+static VkResult settle(Harness &harness, VkSwapchainKHR swapchain)
+{
+  std::vector<VkResult> results;
+  return settle(harness, {swapchain}, results);
+}
+
+// Only the HDR swapchains turn suboptimal when the compositor prefers SDR
+static void test_preferred_sdr()
+{
+  Harness harness;
+  MockCompositor &compositor = harness.compositor();
+
+  VkSurfaceKHR hdrSurface = harness.createSurface(harness.createWlSurface());
+  VkSurfaceKHR sdrSurface = harness.createSurface(harness.createWlSurface());
+  VkSurfaceKHR scrgbSurface = harness.createSurface(harness.createWlSurface());
+  VkSwapchainKHR hdr = harness.createSwapchain(hdrSurface, VK_PRESENT_MODE_FIFO_KHR, VK_FORMAT_A2B10G10R10_UNORM_PACK32, VK_COLOR_SPACE_HDR10_ST2084_EXT);
+  VkSwapchainKHR sdr = harness.createSwapchain(sdrSurface, VK_PRESENT_MODE_FIFO_KHR);
+  VkSwapchainKHR scrgb = harness.createSwapchain(scrgbSurface, VK_PRESENT_MODE_FIFO_KHR, VK_FORMAT_R16G16B16A16_SFLOAT, VK_COLOR_SPACE_EXTENDED_SRGB_LINEAR_EXT);
+
+  std::vector<VkResult> results;
+  CHECK(settle(harness, {hdr, sdr, scrgb}, results) == VK_SUCCESS);
+  CHECK((results == std::vector<VkResult>{VK_SUCCESS, VK_SUCCESS, VK_SUCCESS}));
+
+  // Moved to an SDR output. scRGB counts as HDR too, it has an extended volume.
+  compositor.setPreferred(s_PrimariesSrgb, s_TfSrgb);
+  CHECK(settle(harness, {hdr, sdr, scrgb}, results) == VK_SUBOPTIMAL_KHR);
+  CHECK((results == std::vector<VkResult>{VK_SUBOPTIMAL_KHR, VK_SUCCESS, VK_SUBOPTIMAL_KHR}));
+  CHECK(compositor.count("wp_color_management_surface_v1.get_preferred") == 6);
+
+  // An app that recreates with the same colorspace is not told again and again
+  VkSwapchainKHR oldHdr = hdr;
+  hdr = harness.createSwapchain(hdrSurface, VK_PRESENT_MODE_FIFO_KHR, VK_FORMAT_A2B10G10R10_UNORM_PACK32, VK_COLOR_SPACE_HDR10_ST2084_EXT, oldHdr);
+  harness.destroySwapchain(oldHdr);
+  settle(harness, {hdr, sdr, scrgb}, results);
+  CHECK((results == std::vector<VkResult>{VK_SUCCESS, VK_SUCCESS, VK_SUBOPTIMAL_KHR}));
+
+  // Back on an HDR output, the swapchain that was never recreated is fine again
+  compositor.setPreferred(s_PrimariesBt2020, s_TfPq);
+  CHECK(settle(harness, {hdr, sdr, scrgb}, results) == VK_SUCCESS);
+  CHECK((results == std::vector<VkResult>{VK_SUCCESS, VK_SUCCESS, VK_SUCCESS}));
+
+  harness.destroySwapchain(hdr);
+  harness.destroySwapchain(sdr);
+  harness.destroySwapchain(scrgb);
+  harness.destroySurface(hdrSurface);
+  harness.destroySurface(sdrSurface);
+  harness.destroySurface(scrgbSurface);
+  harness.roundtrip();
+  CHECK(harness.connected());
+}
+
+// Descriptions of a removed color manager are dropped, the surface is tagged
+// again once a new one is announced and its capabilities are known.
+static void test_manager_restart()
+{
+  Harness harness;
+  MockCompositor &compositor = harness.compositor();
+
+  VkSurfaceKHR surface = harness.createSurface(harness.createWlSurface());
+  VkSwapchainKHR swapchain = harness.createSwapchain(surface, VK_PRESENT_MODE_FIFO_KHR, VK_FORMAT_A2B10G10R10_UNORM_PACK32, VK_COLOR_SPACE_HDR10_ST2084_EXT);
+  CHECK(settle(harness, swapchain) == VK_SUCCESS);
+
+  uint32_t colorSurface = compositor.last("wp_color_manager_v1.get_color_management_surface")->args[0];
+  uint32_t description = compositor.last("wp_image_description_creator_params_v1.create")->args[0];
+  auto tagged = compositor.last("wp_color_management_surface_v1.set_image_description");
+  CHECK(tagged && tagged->object == colorSurface && tagged->args[0] == description);
+  CHECK(compositor.count("wp_color_management_surface_v1.set_image_description") == 1);
+
+  compositor.removeColorManager();
+  CHECK(settle(harness, swapchain) == VK_SUBOPTIMAL_KHR);
+  CHECK(compositor.count("wp_color_management_surface_v1.destroy", colorSurface) == 1);
+  CHECK(compositor.count("wp_color_manager_v1.destroy") == 1);
+  CHECK(compositor.count("wp_image_description_v1.destroy", description) == 1);
+  CHECK(compositor.count("wp_color_management_surface_v1.set_image_description") == 1);
+
+  // One new description for the new manager, created once its capabilities arrived
+  compositor.addColorManager();
+  CHECK(settle(harness, swapchain) == VK_SUCCESS);
+  CHECK(compositor.count("wp_color_manager_v1.get_color_management_surface") == 2);
+  CHECK(compositor.count("wp_color_manager_v1.new_parametric_creator") == 2);
+  uint32_t newColorSurface = compositor.last("wp_color_manager_v1.get_color_management_surface")->args[0];
+  uint32_t newDescription = compositor.last("wp_image_description_creator_params_v1.create")->args[0];
+  tagged = compositor.last("wp_color_management_surface_v1.set_image_description");
+  CHECK(tagged && tagged->object == newColorSurface && tagged->args[0] == newDescription);
+  CHECK(compositor.count("wp_color_management_surface_v1.set_image_description") == 2);
+
+  harness.destroySwapchain(swapchain);
+  harness.destroySurface(surface);
+  harness.roundtrip();
+  CHECK(harness.connected());
+}
+
+int main()
+{
+  test_preferred_sdr();
+  test_manager_restart();
+  return 0;
+}
@@ -0,0 +1,131 @@
+// vkSetHdrMetadataEXT coalescing: jitter below the threshold never reaches
+// the compositor, a significant change waits for the rate limit and is then
+// sent by a present on its own, and one that falls back into the hysteresis
+// band is cancelled.
+//
+// Runs with HDR_WSI_METADATA_MAX_RATE=5 and the default thresholds: 5% of
+// the value, at least 2 nits, and a hysteresis of half of that.
+#include "harness.h"
+
+#include <chrono>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <unistd.h>
+
+using namespace HdrLayerTest;
+
+// Longer than the 200ms between two descriptions
+static constexpr std::chrono::milliseconds s_RateInterval{250};
+
+static VkHdrMetadataEXT metadata(float maxFall)
+{
+  return VkHdrMetadataEXT{
+      .sType = VK_STRUCTURE_TYPE_HDR_METADATA_EXT,
+      .displayPrimaryRed = {0.708f, 0.292f},
+      .displayPrimaryGreen = {0.170f, 0.797f},
+      .displayPrimaryBlue = {0.131f, 0.046f},
+      .whitePoint = {0.3127f, 0.3290f},
+      .maxLuminance = 1000.0f,
+      .minLuminance = 0.01f,
+      .maxContentLightLevel = 1000.0f,
+      .maxFrameAverageLightLevel = maxFall,
+  };
+}
+
+static void settle(Harness &harness, VkSwapchainKHR swapchain)
+{
+  for (int i = 0; i < 5; i++)
+  {
+    harness.roundtrip();
+    CHECK(harness.present(swapchain) == VK_SUCCESS);
+  }
+}
+
+// What the layer writes to stderr while destroying the swapchain
+static std::string destroy_capturing_stderr(Harness &harness, VkSwapchainKHR swapchain)
+{
+  FILE *capture = tmpfile();
+  CHECK(capture);
+  fflush(stderr);
+  int saved = dup(STDERR_FILENO);
+  dup2(fileno(capture), STDERR_FILENO);
+
+  harness.destroySwapchain(swapchain);
+
+  fflush(stderr);
+  dup2(saved, STDERR_FILENO);
+  close(saved);
+
+  std::string output;
+  char buffer[256];
+  rewind(capture);
+  while (size_t size = fread(buffer, 1, sizeof(buffer), capture))
+    output.append(buffer, size);
+  fclose(capture);
+  return output;
+}
+
+int main()
+{
+  Harness harness;
+  MockCompositor &compositor = harness.compositor();
+
+  VkSurfaceKHR surface = harness.createSurface(harness.createWlSurface());
+  VkSwapchainKHR swapchain = harness.createSwapchain(surface, VK_PRESENT_MODE_FIFO_KHR, VK_FORMAT_A2B10G10R10_UNORM_PACK32, VK_COLOR_SPACE_HDR10_ST2084_EXT);
+  settle(harness, swapchain);
+  CHECK(compositor.count("wp_image_description_creator_params_v1.create") == 1);
+  CHECK(compositor.count("wp_color_management_surface_v1.set_image_description") == 1);
+
+  // The first metadata goes out right away
+  harness.setHdrMetadata(swapchain, metadata(400.0f));
+  settle(harness, swapchain);
+  CHECK(compositor.count("wp_image_description_creator_params_v1.create") == 2);
+  CHECK(compositor.count("wp_color_management_surface_v1.set_image_description") == 2);
+
+  // MaxFALL measured per frame, +-10 nits around 400 stays within 20 nits
+  for (int i = 0; i < 100; i++)
+  {
+    harness.setHdrMetadata(swapchain, metadata(i % 2 ? 390.0f : 410.0f));
+    CHECK(harness.present(swapchain) == VK_SUCCESS);
+  }
+  harness.roundtrip();
+  CHECK(compositor.count("wp_image_description_creator_params_v1.create") == 2);
+  CHECK(compositor.count("wp_color_management_surface_v1.set_image_description") == 2);
+
+  // A step goes out once the rate limit allows. The ones right after it are
+  // merged into a single pending update.
+  std::this_thread::sleep_for(s_RateInterval);
+  harness.setHdrMetadata(swapchain, metadata(480.0f));
+  harness.setHdrMetadata(swapchain, metadata(560.0f));
+  harness.setHdrMetadata(swapchain, metadata(580.0f));
+  harness.roundtrip();
+  CHECK(compositor.count("wp_image_description_creator_params_v1.create") == 3);
+  CHECK((compositor.last("wp_image_description_creator_params_v1.set_max_fall")->args == std::vector<uint32_t>{480}));
+
+  // Sent by a later present, without another vkSetHdrMetadataEXT
+  std::this_thread::sleep_for(s_RateInterval);
+  settle(harness, swapchain);
+  CHECK(compositor.count("wp_image_description_creator_params_v1.create") == 4);
+  CHECK((compositor.last("wp_image_description_creator_params_v1.set_max_fall")->args == std::vector<uint32_t>{580}));
+  CHECK(compositor.count("wp_color_management_surface_v1.set_image_description") == 4);
+
+  // 640 is significant, but waits for the rate limit. Falling back to 590
+  // is within half the threshold of 580 and cancels it.
+  harness.setHdrMetadata(swapchain, metadata(640.0f));
+  harness.setHdrMetadata(swapchain, metadata(590.0f));
+  std::this_thread::sleep_for(s_RateInterval);
+  settle(harness, swapchain);
+  CHECK(compositor.count("wp_image_description_creator_params_v1.create") == 4);
+  CHECK(compositor.count("wp_color_management_surface_v1.set_image_description") == 4);
+
+  // 1 + 100 + 3 + 2 calls. Sent: 400, 480 and 580. Dropped: the jitter and
+  // 590. Merged: 580 replacing the pending 560.
+  std::string log = destroy_capturing_stderr(harness, swapchain);
+  CHECK(log.find("HDR metadata updates: 106 received, 3 applied, 101 dropped, 1 merged") != std::string::npos);
+
+  harness.destroySurface(surface);
+  harness.roundtrip();
+  CHECK(harness.connected());
+  return 0;
+}
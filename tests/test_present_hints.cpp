@@ -0,0 +1,117 @@
+// Tearing control and content type hints: sent once per swapchain, never
+// from QueuePresentKHR, no tearing control object for vsync'ed swapchains,
+// with and without color management on the compositor.
+//
+// Runs with HDR_WSI_TEARING_CONTROL=1 HDR_WSI_CONTENT_TYPE=auto, or with
+// --disabled and neither set.
+#include "harness.h"
+
+#include <cstring>
+
+using namespace HdrLayerTest;
+
+static constexpr uint32_t s_HintAsync = 1;
+static constexpr uint32_t s_HintVsync = 0;
+static constexpr uint32_t s_ContentTypeNone = 0;
+static constexpr uint32_t s_ContentTypeGame = 3;
+
+static void test_hints(bool colorManagement)
+{
+  Harness harness({.compositor = {.colorManagement = colorManagement}});
+  MockCompositor &compositor = harness.compositor();
+
+  wl_surface *wlSurface = harness.createWlSurface();
+  VkSurfaceKHR surface = harness.createSurface(wlSurface);
+
+  // One hint per swapchain, before its first commit
+  VkSwapchainKHR swapchain = harness.createSwapchain(surface, VK_PRESENT_MODE_IMMEDIATE_KHR);
+  for (int i = 0; i < 10; i++)
+    CHECK(harness.present(swapchain) == VK_SUCCESS);
+  harness.roundtrip();
+
+  CHECK(compositor.count("wp_tearing_control_manager_v1.get_tearing_control") == 1);
+  CHECK(compositor.count("wp_tearing_control_v1.set_presentation_hint") == 1);
+  CHECK(compositor.last("wp_tearing_control_v1.set_presentation_hint")->args == std::vector<uint32_t>{s_HintAsync});
+  CHECK(compositor.count("wp_content_type_manager_v1.get_surface_content_type") == 1);
+  CHECK(compositor.count("wp_content_type_v1.set_content_type") == 1);
+  CHECK(compositor.last("wp_content_type_v1.set_content_type")->args == std::vector<uint32_t>{s_ContentTypeGame});
+
+  ptrdiff_t firstCommit = compositor.find("wl_surface.commit", Harness::id(wlSurface));
+  CHECK(firstCommit >= 0);
+  CHECK(compositor.find("wp_tearing_control_v1.set_presentation_hint") < firstCommit);
+  CHECK(compositor.find("wp_content_type_v1.set_content_type") < firstCommit);
+  CHECK(compositor.count("wl_surface.commit", Harness::id(wlSurface)) == 10);
+
+  // Recreating as FIFO reuses the objects and switches the hints back
+  VkSwapchainKHR oldSwapchain = swapchain;
+  swapchain = harness.createSwapchain(surface, VK_PRESENT_MODE_FIFO_KHR, VK_FORMAT_B8G8R8A8_UNORM, VK_COLOR_SPACE_SRGB_NONLINEAR_KHR, oldSwapchain);
+  harness.destroySwapchain(oldSwapchain);
+  for (int i = 0; i < 10; i++)
+    CHECK(harness.present(swapchain) == VK_SUCCESS);
+  harness.roundtrip();
+
+  CHECK(compositor.count("wp_tearing_control_manager_v1.get_tearing_control") == 1);
+  CHECK(compositor.count("wp_tearing_control_v1.set_presentation_hint") == 2);
+  CHECK(compositor.last("wp_tearing_control_v1.set_presentation_hint")->args == std::vector<uint32_t>{s_HintVsync});
+  CHECK(compositor.count("wp_content_type_manager_v1.get_surface_content_type") == 1);
+  CHECK(compositor.count("wp_content_type_v1.set_content_type") == 2);
+  CHECK(compositor.last("wp_content_type_v1.set_content_type")->args == std::vector<uint32_t>{s_ContentTypeNone});
+
+  harness.destroySwapchain(swapchain);
+  harness.destroySurface(surface);
+
+  // A FIFO swapchain never creates a tearing control or content type object
+  wl_surface *fifoWlSurface = harness.createWlSurface();
+  VkSurfaceKHR fifoSurface = harness.createSurface(fifoWlSurface);
+  VkSwapchainKHR fifoSwapchain = harness.createSwapchain(fifoSurface, VK_PRESENT_MODE_FIFO_KHR);
+  for (int i = 0; i < 10; i++)
+    CHECK(harness.present(fifoSwapchain) == VK_SUCCESS);
+  harness.roundtrip();
+
+  CHECK(compositor.count("wp_tearing_control_manager_v1.get_tearing_control") == 1);
+  CHECK(compositor.count("wp_content_type_manager_v1.get_surface_content_type") == 1);
+
+  harness.destroySwapchain(fifoSwapchain);
+  harness.destroySurface(fifoSurface);
+  harness.roundtrip();
+  CHECK(harness.connected());
+}
+
+// Without HDR_WSI_TEARING_CONTROL and HDR_WSI_CONTENT_TYPE the layer leaves
+// both protocols to the driver and the application.
+static void test_disabled()
+{
+  Harness harness;
+  MockCompositor &compositor = harness.compositor();
+
+  VkSurfaceKHR surface = harness.createSurface(harness.createWlSurface());
+  VkSwapchainKHR swapchain = harness.createSwapchain(surface, VK_PRESENT_MODE_IMMEDIATE_KHR);
+  for (int i = 0; i < 10; i++)
+    CHECK(harness.present(swapchain) == VK_SUCCESS);
+  harness.roundtrip();
+
+  for (const MockRequest &request : compositor.requests())
+  {
+    CHECK(request.name.rfind("wp_tearing_control", 0) != 0);
+    CHECK(request.name.rfind("wp_content_type", 0) != 0);
+  }
+
+  harness.destroySwapchain(swapchain);
+  harness.destroySurface(surface);
+  CHECK(harness.connected());
+}
+
+int main(int argc, char **argv)
+{
+  if (argc > 1 && strcmp(argv[1], "--disabled") == 0)
+  {
+    unsetenv("HDR_WSI_TEARING_CONTROL");
+    unsetenv("HDR_WSI_CONTENT_TYPE");
+    test_disabled();
+    return 0;
+  }
+
+  test_hints(true);
+  test_hints(false);
+  return 0;
+}
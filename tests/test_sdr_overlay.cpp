@@ -0,0 +1,286 @@
+// VK_HDRWSI_sdr_overlay: the subsurface the driver surface is created on,
+// its sync mode, its sRGB image description, the pNext chain the driver sees
+// and the order things are torn down in.
+#include "harness.h"
+
+#include <vk_hdrwsi_sdr_overlay.h>
+
+#include <algorithm>
+
+using namespace HdrLayerTest;
+
+static constexpr VkStructureType s_DummyTypeA = VkStructureType(0x48445298);
+static constexpr VkStructureType s_DummyTypeB = VkStructureType(0x48445299);
+
+struct DriverSurfaces
+{
+  Harness *harness;
+  uint32_t createdId = 0;
+  std::vector<VkStructureType> pNextTypes;
+
+  // Taken inside the driver's vkDestroySurfaceKHR, once the compositor
+  // caught up with everything sent before it
+  bool destroyed = false;
+  size_t subsurfaceDestroys = 0;
+  size_t surfaceDestroys = 0;
+};
+
+static void install_hooks(Harness &harness, DriverSurfaces &surfaces)
+{
+  surfaces.harness = &harness;
+  harness.setIcdHooks(StubIcdHooks{
+      .user = &surfaces,
+      .surfaceCreated = [](void *user, uint32_t wlSurfaceId, const VkStructureType *pNextTypes, uint32_t pNextCount)
+      {
+        auto surfaces = static_cast<DriverSurfaces *>(user);
+        surfaces->createdId = wlSurfaceId;
+        surfaces->pNextTypes.assign(pNextTypes, pNextTypes + pNextCount);
+      },
+      .surfaceDestroyed = [](void *user, uint32_t wlSurfaceId)
+      {
+        auto surfaces = static_cast<DriverSurfaces *>(user);
+        surfaces->harness->roundtrip();
+        surfaces->destroyed = true;
+        surfaces->subsurfaceDestroys = surfaces->harness->compositor().count("wl_subsurface.destroy");
+        surfaces->surfaceDestroys = surfaces->harness->compositor().count("wl_surface.destroy", wlSurfaceId);
+      },
+  });
+}
+
+static VkWaylandSdrOverlaySurfaceCreateInfoHDRWSI overlay_info(const void *pNext, VkBool32 desynchronized)
+{
+  return VkWaylandSdrOverlaySurfaceCreateInfoHDRWSI{
+      .sType = VK_STRUCTURE_TYPE_WAYLAND_SDR_OVERLAY_SURFACE_CREATE_INFO_HDRWSI,
+      .pNext = pNext,
+      .x = 16,
+      .y = 32,
+      .desynchronized = desynchronized,
+  };
+}
+
+static void test_overlay(bool desynchronized)
+{
+  Harness harness({.sdrOverlay = true});
+  MockCompositor &compositor = harness.compositor();
+  DriverSurfaces driver;
+  install_hooks(harness, driver);
+
+  wl_surface *parent = harness.createWlSurface();
+
+  // The overlay struct sits in the middle of the chain, which the driver
+  // gets as is, unknown structures are skipped there.
+  VkBaseInStructure dummyB = {.sType = s_DummyTypeB, .pNext = nullptr};
+  VkWaylandSdrOverlaySurfaceCreateInfoHDRWSI overlayInfo = overlay_info(&dummyB, desynchronized);
+  VkBaseInStructure dummyA = {.sType = s_DummyTypeA, .pNext = reinterpret_cast<const VkBaseInStructure *>(&overlayInfo)};
+  VkSurfaceKHR surface = harness.createSurface(parent, &dummyA);
+  harness.roundtrip();
+
+  CHECK((driver.pNextTypes == std::vector<VkStructureType>{s_DummyTypeA, VK_STRUCTURE_TYPE_WAYLAND_SDR_OVERLAY_SURFACE_CREATE_INFO_HDRWSI, s_DummyTypeB}));
+
+  // The driver surface is a new subsurface of the parent, on top of it
+  uint32_t overlayId = driver.createdId;
+  CHECK(overlayId != 0 && overlayId != Harness::id(parent));
+  auto subsurface = compositor.last("wl_subcompositor.get_subsurface");
+  CHECK(subsurface);
+  CHECK(subsurface->args[1] == overlayId);
+  CHECK(subsurface->args[2] == Harness::id(parent));
+  uint32_t subsurfaceId = subsurface->args[0];
+  CHECK((compositor.last("wl_subsurface.set_position", subsurfaceId)->args == std::vector<uint32_t>{16, 32}));
+  CHECK((compositor.last("wl_subsurface.place_above", subsurfaceId)->args == std::vector<uint32_t>{Harness::id(parent)}));
+  CHECK(compositor.count("wl_subsurface.set_desync", subsurfaceId) == (desynchronized ? 1 : 0));
+  CHECK(compositor.count("wl_subsurface.set_sync", subsurfaceId) == 0);
+  CHECK(compositor.count("wl_surface.set_input_region", overlayId) == 1);
+
+  // Tagged as plain sRGB
+  CHECK(compositor.count("wp_color_manager_v1.new_parametric_creator") == 1);
+  CHECK((compositor.last("wp_image_description_creator_params_v1.set_primaries_cicp")->args == std::vector<uint32_t>{1}));
+  CHECK((compositor.last("wp_image_description_creator_params_v1.set_tf_cicp")->args == std::vector<uint32_t>{13}));
+  CHECK(compositor.count("wp_image_description_creator_params_v1.set_mastering_luminance") == 0);
+  CHECK(compositor.count("wp_image_description_creator_params_v1.set_max_cll") == 0);
+  CHECK(compositor.count("wp_image_description_creator_params_v1.set_max_fall") == 0);
+  CHECK(compositor.count("wp_image_description_creator_params_v1.destroy") == 1);
+  auto colorSurface = compositor.last("wp_color_manager_v1.get_color_management_surface");
+  CHECK(colorSurface && colorSurface->args[1] == overlayId);
+  CHECK(compositor.count("wp_color_management_surface_v1.set_image_description", colorSurface->args[0]) == 1);
+
+  // The driver lets go of the wl_surface first, then the layer destroys the
+  // subsurface role before the surface itself
+  harness.destroySurface(surface);
+  harness.roundtrip();
+  CHECK(driver.destroyed);
+  CHECK(driver.subsurfaceDestroys == 0);
+  CHECK(driver.surfaceDestroys == 0);
+  ptrdiff_t subsurfaceDestroy = compositor.find("wl_subsurface.destroy", subsurfaceId);
+  ptrdiff_t surfaceDestroy = compositor.find("wl_surface.destroy", overlayId);
+  CHECK(subsurfaceDestroy >= 0 && surfaceDestroy >= 0);
+  CHECK(subsurfaceDestroy < surfaceDestroy);
+
+  CHECK(harness.connected());
+}
+
+// The overlay swapchain presents to the subsurface, never to the parent or
+// its image description, and the overlay can go away under a live parent
+// swapchain.
+static void test_overlay_swapchain()
+{
+  Harness harness({.sdrOverlay = true});
+  MockCompositor &compositor = harness.compositor();
+  DriverSurfaces driver;
+  install_hooks(harness, driver);
+
+  wl_surface *parent = harness.createWlSurface();
+  uint32_t parentId = Harness::id(parent);
+  VkSurfaceKHR parentSurface = harness.createSurface(parent);
+  VkSwapchainKHR parentSwapchain = harness.createSwapchain(parentSurface, VK_PRESENT_MODE_FIFO_KHR, VK_FORMAT_A2B10G10R10_UNORM_PACK32, VK_COLOR_SPACE_HDR10_ST2084_EXT);
+  CHECK(harness.present(parentSwapchain) == VK_SUCCESS);
+  harness.roundtrip();
+  uint32_t parentColorSurface = compositor.last("wp_color_manager_v1.get_color_management_surface")->args[0];
+  auto parentDescription = compositor.last("wp_color_management_surface_v1.set_image_description", parentColorSurface);
+  CHECK(parentDescription);
+
+  VkWaylandSdrOverlaySurfaceCreateInfoHDRWSI overlayInfo = overlay_info(nullptr, VK_FALSE);
+  VkSurfaceKHR overlaySurface = harness.createSurface(parent, &overlayInfo);
+  uint32_t overlayId = driver.createdId;
+  CHECK(overlayId != 0 && overlayId != parentId);
+  VkSwapchainKHR overlaySwapchain = harness.createSwapchain(overlaySurface, VK_PRESENT_MODE_FIFO_KHR);
+  for (int i = 0; i < 10; i++)
+    CHECK(harness.present(overlaySwapchain) == VK_SUCCESS);
+  harness.roundtrip();
+
+  CHECK(compositor.count("wl_surface.commit", overlayId) == 10);
+  CHECK(compositor.count("wl_surface.commit", parentId) == 1);
+  CHECK(compositor.count("wp_color_management_surface_v1.set_image_description", parentColorSurface) == 1);
+  CHECK(compositor.count("wp_color_management_surface_v1.set_default_image_description", parentColorSurface) == 0);
+  CHECK(compositor.count("wp_color_management_surface_v1.set_image_description") == 2);
+
+  // Both swapchains in one present, each commits its own surface
+  std::vector<VkResult> results;
+  CHECK(harness.present({parentSwapchain, overlaySwapchain}, results) == VK_SUCCESS);
+  harness.roundtrip();
+  CHECK(compositor.count("wl_surface.commit", overlayId) == 11);
+  CHECK(compositor.count("wl_surface.commit", parentId) == 2);
+
+  // Tearing the overlay down leaves the parent and its description alone
+  harness.destroySwapchain(overlaySwapchain);
+  harness.destroySurface(overlaySurface);
+  for (int i = 0; i < 10; i++)
+    CHECK(harness.present(parentSwapchain) == VK_SUCCESS);
+  harness.roundtrip();
+  CHECK(compositor.count("wl_surface.destroy", overlayId) == 1);
+  CHECK(compositor.count("wl_surface.commit", parentId) == 12);
+  CHECK(compositor.count("wp_color_management_surface_v1.set_image_description", parentColorSurface) == 1);
+  CHECK(compositor.last("wp_color_management_surface_v1.set_image_description", parentColorSurface)->args == parentDescription->args);
+
+  harness.destroySwapchain(parentSwapchain);
+  harness.destroySurface(parentSurface);
+  harness.roundtrip();
+  CHECK(harness.connected());
+}
+
+// The chain may live in read-only memory, the layer must never write to it
+static void test_const_chain()
+{
+  static const VkBaseInStructure s_dummyB = {.sType = s_DummyTypeB, .pNext = nullptr};
+  static const VkWaylandSdrOverlaySurfaceCreateInfoHDRWSI s_overlayInfo = {
+      .sType = VK_STRUCTURE_TYPE_WAYLAND_SDR_OVERLAY_SURFACE_CREATE_INFO_HDRWSI,
+      .pNext = &s_dummyB,
+      .x = 0,
+      .y = 0,
+      .desynchronized = VK_FALSE,
+  };
+  static const VkBaseInStructure s_dummyA = {.sType = s_DummyTypeA, .pNext = reinterpret_cast<const VkBaseInStructure *>(&s_overlayInfo)};
+
+  Harness harness({.sdrOverlay = true});
+  DriverSurfaces driver;
+  install_hooks(harness, driver);
+
+  wl_surface *parent = harness.createWlSurface();
+  VkSurfaceKHR surface = harness.createSurface(parent, &s_dummyA);
+  CHECK(driver.createdId != Harness::id(parent));
+  CHECK((driver.pNextTypes == std::vector<VkStructureType>{s_DummyTypeA, VK_STRUCTURE_TYPE_WAYLAND_SDR_OVERLAY_SURFACE_CREATE_INFO_HDRWSI, s_DummyTypeB}));
+
+  // First in the chain it is left out of the layer's own copy
+  VkSurfaceKHR headSurface = harness.createSurface(harness.createWlSurface(), &s_overlayInfo);
+  CHECK((driver.pNextTypes == std::vector<VkStructureType>{s_DummyTypeB}));
+
+  harness.destroySurface(headSurface);
+  harness.destroySurface(surface);
+  CHECK(harness.connected());
+}
+
+// Without the instance extension the struct is not honored
+static void test_not_enabled()
+{
+  Harness harness;
+  MockCompositor &compositor = harness.compositor();
+  DriverSurfaces driver;
+  install_hooks(harness, driver);
+
+  wl_surface *parent = harness.createWlSurface();
+  VkWaylandSdrOverlaySurfaceCreateInfoHDRWSI overlayInfo = overlay_info(nullptr, VK_FALSE);
+  VkSurfaceKHR surface = harness.createSurface(parent, &overlayInfo);
+  harness.roundtrip();
+
+  CHECK(driver.createdId == Harness::id(parent));
+  CHECK(driver.pNextTypes.empty());
+  CHECK(compositor.count("wl_subcompositor.get_subsurface") == 0);
+
+  harness.destroySurface(surface);
+  CHECK(harness.connected());
+}
+
+// Without color management the overlay still works, it's just not tagged
+static void test_no_color_management()
+{
+  Harness harness({.sdrOverlay = true, .compositor = {.colorManagement = false}});
+  MockCompositor &compositor = harness.compositor();
+  DriverSurfaces driver;
+  install_hooks(harness, driver);
+
+  wl_surface *parent = harness.createWlSurface();
+  VkWaylandSdrOverlaySurfaceCreateInfoHDRWSI overlayInfo = overlay_info(nullptr, VK_FALSE);
+  VkSurfaceKHR surface = harness.createSurface(parent, &overlayInfo);
+  harness.roundtrip();
+
+  CHECK(driver.createdId != Harness::id(parent));
+  CHECK(compositor.count("wl_subcompositor.get_subsurface") == 1);
+  CHECK(compositor.count("wp_color_manager_v1.get_color_management_surface") == 0);
+
+  harness.destroySurface(surface);
+  CHECK(harness.connected());
+}
+
+// Without wl_subcompositor there is nothing to put the overlay on, the
+// surface ends up on the parent as if the struct wasn't there
+static void test_no_subcompositor()
+{
+  Harness harness({.sdrOverlay = true, .compositor = {.subcompositor = false}});
+  MockCompositor &compositor = harness.compositor();
+  DriverSurfaces driver;
+  install_hooks(harness, driver);
+
+  wl_surface *parent = harness.createWlSurface();
+  VkWaylandSdrOverlaySurfaceCreateInfoHDRWSI overlayInfo = overlay_info(nullptr, VK_FALSE);
+  VkSurfaceKHR surface = harness.createSurface(parent, &overlayInfo);
+  harness.roundtrip();
+
+  CHECK(driver.createdId == Harness::id(parent));
+  CHECK(driver.pNextTypes.empty());
+  CHECK(compositor.count("wl_subcompositor.get_subsurface") == 0);
+
+  harness.destroySurface(surface);
+  harness.roundtrip();
+  CHECK(harness.connected());
+}
+
+int main()
+{
+  test_overlay(false);
+  test_overlay(true);
+  test_overlay_swapchain();
+  test_const_chain();
+  test_not_enabled();
+  test_no_color_management();
+  test_no_subcompositor();
+  return 0;
+}
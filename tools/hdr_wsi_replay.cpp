@@ -0,0 +1,297 @@
+// Replays a trace recorded with HDR_WSI_TRACE=<path> through the layer built
+// in this tree, on the stub ICD and the mock compositor of the tests.
+//
+// Every recorded surface, swapchain, HDR metadata update and present is issued
+// again through the loader, paced like the recording unless --fast is given.
+// Reports the latency of each call, the blocking compositor round trips made
+// in it and what the compositor was sent (image descriptions, hints).
+//
+// Layer options (HDR_WSI_METADATA_*, HDR_WSI_TEARING_CONTROL, ...) are taken
+// from the environment, so the same trace can be replayed with different
+// settings. --fast skips the pacing, which also changes what the metadata rate
+// limit lets through.
+#include "trace_file.h"
+#include "harness.h"
+
+#include <chrono>
+#include <cinttypes>
+#include <map>
+#include <string>
+#include <string_view>
+#include <thread>
+
+using namespace std::literals;
+using namespace HdrLayer;
+using namespace HdrLayerTest;
+
+namespace
+{
+  struct CallStats
+  {
+    uint64_t calls;
+    uint64_t totalNs;
+    uint64_t maxNs;
+    uint64_t roundTrips;
+  };
+
+  class Replay
+  {
+  public:
+    Replay(Harness &harness)
+        : m_harness(harness)
+    {
+    }
+
+    void record(const TraceRecord &record)
+    {
+      switch (record.type)
+      {
+      case TraceType::CreateSurface:
+        if (record.result == VK_SUCCESS)
+          createSurface(record);
+        break;
+      case TraceType::DestroySurface:
+        destroySurface(record);
+        break;
+      case TraceType::CreateSwapchain:
+        if (record.result == VK_SUCCESS)
+          createSwapchain(record);
+        break;
+      case TraceType::DestroySwapchain:
+        destroySwapchain(record);
+        break;
+      case TraceType::SetHdrMetadata:
+        setHdrMetadata(record);
+        break;
+      case TraceType::QueuePresent:
+        present(record);
+        break;
+      }
+    }
+
+    void finish()
+    {
+      for (auto &[handle, swapchain] : m_swapchains)
+        vkDestroySwapchainKHR(m_harness.device(), swapchain, nullptr);
+      for (auto &[handle, surface] : m_surfaces)
+        m_harness.destroySurface(surface);
+      m_swapchains.clear();
+      m_surfaces.clear();
+      m_harness.roundtrip();
+    }
+
+    const std::map<std::string, CallStats> &stats() const { return m_stats; }
+    uint64_t overlays() const { return m_overlays; }
+    uint64_t skipped() const { return m_skipped; }
+
+  private:
+    // Runs one call down the layer, timing it and counting the round trips it waited for
+    template <typename F>
+    void timed(const char *name, F &&call)
+    {
+      size_t syncs = m_harness.compositor().count("wl_display.sync");
+      auto start = std::chrono::steady_clock::now();
+      call();
+      uint64_t ns = uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+
+      CallStats &stats = m_stats[name];
+      stats.calls++;
+      stats.totalNs += ns;
+      stats.maxNs = std::max(stats.maxNs, ns);
+      stats.roundTrips += m_harness.compositor().count("wl_display.sync") - syncs;
+    }
+
+    void createSurface(const TraceRecord &record)
+    {
+      // The parent of an SDR overlay isn't recorded, it's replayed as a plain surface
+      m_overlays += record.overlay;
+      wl_surface *wlSurface = m_harness.createWlSurface();
+      VkSurfaceKHR surface = VK_NULL_HANDLE;
+      timed("vkCreateWaylandSurfaceKHR", [&]()
+            { surface = m_harness.createSurface(wlSurface); });
+      m_surfaces[record.object] = surface;
+    }
+
+    void destroySurface(const TraceRecord &record)
+    {
+      auto it = m_surfaces.find(record.object);
+      if (it == m_surfaces.end())
+      {
+        m_skipped++;
+        return;
+      }
+      timed("vkDestroySurfaceKHR", [&]()
+            { m_harness.destroySurface(it->second); });
+      m_surfaces.erase(it);
+    }
+
+    void createSwapchain(const TraceRecord &record)
+    {
+      auto surface = m_surfaces.find(record.parent);
+      if (surface == m_surfaces.end())
+      {
+        m_skipped++;
+        return;
+      }
+
+      const TraceSwapchainInfo &info = record.swapchain;
+      const VkSwapchainCreateInfoKHR createInfo = {
+          .sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR,
+          .surface = surface->second,
+          .minImageCount = info.imageCount,
+          .imageFormat = VkFormat(info.format),
+          .imageColorSpace = VkColorSpaceKHR(info.colorSpace),
+          .imageExtent = {info.width, info.height},
+          .imageArrayLayers = 1,
+          .imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT,
+          .imageSharingMode = VK_SHARING_MODE_EXCLUSIVE,
+          .preTransform = VK_SURFACE_TRANSFORM_IDENTITY_BIT_KHR,
+          .compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR,
+          .presentMode = VkPresentModeKHR(info.presentMode),
+          .clipped = VK_TRUE,
+      };
+      VkSwapchainKHR swapchain = VK_NULL_HANDLE;
+      VkResult result = VK_SUCCESS;
+      timed("vkCreateSwapchainKHR", [&]()
+            { result = vkCreateSwapchainKHR(m_harness.device(), &createInfo, nullptr, &swapchain); });
+      if (result != VK_SUCCESS)
+      {
+        fprintf(stderr, "Replaying swapchain 0x%" PRIx64 " failed: %d\n", record.object, result);
+        m_skipped++;
+        return;
+      }
+      m_swapchains[record.object] = swapchain;
+    }
+
+    void destroySwapchain(const TraceRecord &record)
+    {
+      auto it = m_swapchains.find(record.object);
+      if (it == m_swapchains.end())
+      {
+        m_skipped++;
+        return;
+      }
+      timed("vkDestroySwapchainKHR", [&]()
+            { vkDestroySwapchainKHR(m_harness.device(), it->second, nullptr); });
+      m_swapchains.erase(it);
+    }
+
+    void setHdrMetadata(const TraceRecord &record)
+    {
+      auto it = m_swapchains.find(record.object);
+      if (it == m_swapchains.end())
+      {
+        m_skipped++;
+        return;
+      }
+
+      const TraceMetadata &recorded = record.metadata;
+      const VkHdrMetadataEXT metadata = {
+          .sType = VK_STRUCTURE_TYPE_HDR_METADATA_EXT,
+          .displayPrimaryRed = {recorded.displayPrimaryRed[0], recorded.displayPrimaryRed[1]},
+          .displayPrimaryGreen = {recorded.displayPrimaryGreen[0], recorded.displayPrimaryGreen[1]},
+          .displayPrimaryBlue = {recorded.displayPrimaryBlue[0], recorded.displayPrimaryBlue[1]},
+          .whitePoint = {recorded.whitePoint[0], recorded.whitePoint[1]},
+          .maxLuminance = recorded.maxLuminance,
+          .minLuminance = recorded.minLuminance,
+          .maxContentLightLevel = recorded.maxContentLightLevel,
+          .maxFrameAverageLightLevel = recorded.maxFrameAverageLightLevel,
+      };
+      timed("vkSetHdrMetadataEXT", [&]()
+            { m_harness.setHdrMetadata(it->second, metadata); });
+    }
+
+    void present(const TraceRecord &record)
+    {
+      auto it = m_swapchains.find(record.object);
+      if (it == m_swapchains.end())
+      {
+        m_skipped++;
+        return;
+      }
+
+      uint32_t imageIndex = 0;
+      if (vkAcquireNextImageKHR(m_harness.device(), it->second, UINT64_MAX, VK_NULL_HANDLE, VK_NULL_HANDLE, &imageIndex) < 0)
+      {
+        m_skipped++;
+        return;
+      }
+      const VkPresentInfoKHR presentInfo = {
+          .sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR,
+          .swapchainCount = 1,
+          .pSwapchains = &it->second,
+          .pImageIndices = &imageIndex,
+      };
+      timed("vkQueuePresentKHR", [&]()
+            { vkQueuePresentKHR(m_harness.queue(), &presentInfo); });
+    }
+
+    Harness &m_harness;
+    std::map<uint64_t, VkSurfaceKHR> m_surfaces;
+    std::map<uint64_t, VkSwapchainKHR> m_swapchains;
+    std::map<std::string, CallStats> m_stats;
+    uint64_t m_overlays = 0;
+    uint64_t m_skipped = 0;
+  };
+}
+
+int main(int argc, char **argv)
+{
+  bool fast = argc == 3 && argv[1] == "--fast"sv;
+  if (argc != 2 && !fast)
+  {
+    fprintf(stderr, "usage: %s [--fast] <trace file>\n", argv[0]);
+    return 1;
+  }
+  const char *path = argv[argc - 1];
+
+  TraceFile trace;
+  if (!open_trace(path, trace))
+    return 1;
+  if (!trace.count)
+  {
+    fprintf(stderr, "%s has no records\n", path);
+    return 1;
+  }
+
+  Harness harness;
+  Replay replay(harness);
+
+  auto start = std::chrono::steady_clock::now();
+  uint64_t firstNs = trace.records[0].timestampNs;
+  for (uint64_t i = 0; i < trace.count; i++)
+  {
+    const TraceRecord &record = trace.records[i];
+    // Records from different threads can be slightly out of order
+    if (!fast && record.timestampNs > firstNs)
+      std::this_thread::sleep_until(start + std::chrono::nanoseconds(record.timestampNs - firstNs));
+    replay.record(record);
+
+    // Keeps the connection drained, like the application's own event loop would
+    if (i % 1024 == 1023)
+      harness.roundtrip();
+  }
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  replay.finish();
+  CHECK(harness.connected());
+
+  printf("%" PRIu64 " records replayed in %.2f s%s, %" PRIu64 " skipped, %" PRIu64 " SDR overlays replayed as plain surfaces\n\n",
+         trace.count, seconds, fast ? " (--fast)" : "", replay.skipped(), replay.overlays());
+
+  printf("%-26s %10s %12s %12s %12s\n", "", "calls", "avg us", "max us", "round trips");
+  for (const auto &[name, stats] : replay.stats())
+  {
+    printf("%-26s %10" PRIu64 " %12.2f %12.2f %12" PRIu64 "\n", name.c_str(), stats.calls,
+           double(stats.totalNs) / double(stats.calls) / 1000.0, double(stats.maxNs) / 1000.0, stats.roundTrips);
+  }
+
+  MockCompositor &compositor = harness.compositor();
+  printf("\ncompositor: %zu image descriptions created, %zu set_image_description, %zu set_default_image_description, "
+         "%zu tearing hints, %zu content types\n",
+         compositor.count("wp_image_description_creator_params_v1.create"),
+         compositor.count("wp_color_management_surface_v1.set_image_description"),
+         compositor.count("wp_color_management_surface_v1.set_default_image_description"),
+         compositor.count("wp_tearing_control_v1.set_presentation_hint"),
+         compositor.count("wp_content_type_v1.set_content_type"));
+  return 0;
+}
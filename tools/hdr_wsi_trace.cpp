@@ -0,0 +1,194 @@
+// Offline summary of traces recorded with HDR_WSI_TRACE=<path>.
+//
+// Walks the recorded call stream per swapchain and reports present cadence,
+// how often HDR metadata is set and how many of those calls changed the
+// metadata, i.e. the most image descriptions the layer could have created
+// before coalescing. hdr-wsi-replay shows what the layer actually does with
+// the same calls.
+#include "trace_file.h"
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <map>
+#include <optional>
+
+using namespace HdrLayer;
+
+namespace
+{
+  struct SwapchainSummary
+  {
+    TraceSwapchainInfo info;
+    uint64_t surface;
+    uint64_t created;
+    uint64_t destroyed;
+
+    uint64_t presents;
+    uint64_t suboptimal;
+    uint64_t firstPresent;
+    uint64_t lastPresent;
+    uint64_t minInterval;
+    uint64_t maxInterval;
+
+    uint64_t metadataCalls;
+    uint64_t metadataChanges;
+    uint64_t maxChangesPerSecond;
+    uint64_t changesThisSecond;
+    uint64_t secondStart;
+    std::optional<TraceMetadata> metadata;
+  };
+
+  bool same_metadata(const TraceMetadata &a, const TraceMetadata &b)
+  {
+    return memcmp(&a, &b, sizeof(TraceMetadata)) == 0;
+  }
+
+  double ms(uint64_t ns)
+  {
+    return double(ns) / 1000000.0;
+  }
+
+  void summarize(const TraceRecord &record, std::map<uint64_t, SwapchainSummary> &swapchains)
+  {
+    switch (record.type)
+    {
+    case TraceType::CreateSwapchain:
+      if (record.object)
+      {
+        swapchains[record.object] = SwapchainSummary{
+            .info = record.swapchain,
+            .surface = record.parent,
+            .created = record.timestampNs,
+            .destroyed = 0,
+            .presents = 0,
+            .suboptimal = 0,
+            .firstPresent = 0,
+            .lastPresent = 0,
+            .minInterval = UINT64_MAX,
+            .maxInterval = 0,
+            .metadataCalls = 0,
+            .metadataChanges = 0,
+            .maxChangesPerSecond = 0,
+            .changesThisSecond = 0,
+            .secondStart = 0,
+            .metadata = std::nullopt,
+        };
+      }
+      break;
+    case TraceType::DestroySwapchain:
+      if (auto it = swapchains.find(record.object); it != swapchains.end())
+        it->second.destroyed = record.timestampNs;
+      break;
+    case TraceType::QueuePresent:
+      if (auto it = swapchains.find(record.object); it != swapchains.end())
+      {
+        SwapchainSummary &swapchain = it->second;
+        if (!swapchain.presents)
+        {
+          swapchain.firstPresent = record.timestampNs;
+        }
+        else
+        {
+          uint64_t interval = record.timestampNs - swapchain.lastPresent;
+          swapchain.minInterval = std::min(swapchain.minInterval, interval);
+          swapchain.maxInterval = std::max(swapchain.maxInterval, interval);
+        }
+        swapchain.lastPresent = record.timestampNs;
+        swapchain.presents++;
+        if (record.result == 1000001003) // VK_SUBOPTIMAL_KHR
+          swapchain.suboptimal++;
+      }
+      break;
+    case TraceType::SetHdrMetadata:
+      if (auto it = swapchains.find(record.object); it != swapchains.end())
+      {
+        SwapchainSummary &swapchain = it->second;
+        swapchain.metadataCalls++;
+        if (swapchain.metadata && same_metadata(*swapchain.metadata, record.metadata))
+          break;
+
+        swapchain.metadata = record.metadata;
+        swapchain.metadataChanges++;
+        if (record.timestampNs - swapchain.secondStart >= 1000000000ull)
+        {
+          swapchain.secondStart = record.timestampNs;
+          swapchain.changesThisSecond = 0;
+        }
+        swapchain.maxChangesPerSecond = std::max(swapchain.maxChangesPerSecond, ++swapchain.changesThisSecond);
+      }
+      break;
+    case TraceType::CreateSurface:
+    case TraceType::DestroySurface:
+      break;
+    }
+  }
+}
+
+int main(int argc, char **argv)
+{
+  if (argc != 2)
+  {
+    fprintf(stderr, "usage: %s <trace file>\n", argv[0]);
+    return 1;
+  }
+
+  TraceFile trace;
+  if (!open_trace(argv[1], trace))
+    return 1;
+  const TraceRecord *records = trace.records;
+  uint64_t count = trace.count;
+  uint64_t total = trace.total;
+
+  uint64_t surfaces = 0;
+  uint64_t overlays = 0;
+  std::map<uint64_t, SwapchainSummary> swapchains;
+  for (uint64_t i = 0; i < count; i++)
+  {
+    if (records[i].type == TraceType::CreateSurface)
+    {
+      surfaces++;
+      overlays += records[i].overlay;
+    }
+    summarize(records[i], swapchains);
+  }
+
+  printf("%" PRIu64 " records (%" PRIu64 " dropped), %" PRIu64 " surfaces (%" PRIu64 " SDR overlays), %zu swapchains\n",
+         count, total - count, surfaces, overlays, swapchains.size());
+
+  for (const auto &[handle, swapchain] : swapchains)
+  {
+    uint64_t end = swapchain.destroyed ? swapchain.destroyed : swapchain.lastPresent;
+    double lifetime = end > swapchain.created ? double(end - swapchain.created) / 1000000000.0 : 0.0;
+
+    printf("\nswapchain 0x%" PRIx64 " (surface 0x%" PRIx64 "): %ux%u format %u colorspace %u present mode %u, %u images, %.2f s%s\n",
+           handle, swapchain.surface, swapchain.info.width, swapchain.info.height,
+           swapchain.info.format, swapchain.info.colorSpace, swapchain.info.presentMode, swapchain.info.imageCount,
+           lifetime, swapchain.destroyed ? "" : " (not destroyed)");
+
+    if (swapchain.presents > 1)
+    {
+      double average = double(swapchain.lastPresent - swapchain.firstPresent) / double(swapchain.presents - 1);
+      printf("  presents: %" PRIu64 ", interval avg %.3f ms, min %.3f ms, max %.3f ms, %" PRIu64 " suboptimal\n",
+             swapchain.presents, ms(uint64_t(average)), ms(swapchain.minInterval), ms(swapchain.maxInterval), swapchain.suboptimal);
+    }
+    else
+    {
+      printf("  presents: %" PRIu64 "\n", swapchain.presents);
+    }
+
+    if (swapchain.metadataCalls)
+    {
+      printf("  SetHdrMetadataEXT: %" PRIu64 " calls (%.2f per present), %" PRIu64 " changed the metadata, up to %" PRIu64 " changes/s\n",
+             swapchain.metadataCalls,
+             swapchain.presents ? double(swapchain.metadataCalls) / double(swapchain.presents) : 0.0,
+             swapchain.metadataChanges, swapchain.maxChangesPerSecond);
+      const TraceMetadata &last = *swapchain.metadata;
+      printf("  last metadata: mastering %.4f - %.1f nits, MaxCLL %.1f nits, MaxFALL %.1f nits\n",
+             last.minLuminance, last.maxLuminance, last.maxContentLightLevel, last.maxFrameAverageLightLevel);
+    }
+  }
+
+  return 0;
+}
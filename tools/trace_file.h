@@ -0,0 +1,72 @@
+#pragma once
+
+#include "hdr_wsi_trace.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Read-only view of a trace written with HDR_WSI_TRACE, shared by the tools.
+namespace HdrLayer
+{
+  struct TraceFile
+  {
+    void *map = nullptr;
+    size_t size = 0;
+    const TraceHeader *header = nullptr;
+    const TraceRecord *records = nullptr;
+    uint64_t count = 0; // records in the file
+    uint64_t total = 0; // records the layer tried to write
+
+    TraceFile() = default;
+    TraceFile(const TraceFile &) = delete;
+    TraceFile &operator=(const TraceFile &) = delete;
+
+    ~TraceFile()
+    {
+      if (map)
+        munmap(map, size);
+    }
+  };
+
+  // Prints why and returns false if the file is not a trace of this version.
+  static bool open_trace(const char *path, TraceFile &trace)
+  {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(TraceHeader))
+    {
+      fprintf(stderr, "Failed to open trace %s\n", path);
+      if (fd >= 0)
+        close(fd);
+      return false;
+    }
+    void *map = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+      fprintf(stderr, "Failed to map trace %s\n", path);
+      return false;
+    }
+    trace.map = map;
+    trace.size = size_t(st.st_size);
+
+    auto header = reinterpret_cast<const TraceHeader *>(map);
+    if (memcmp(header->magic, s_TraceMagic, sizeof(s_TraceMagic)) != 0 || header->version != s_TraceVersion || header->recordSize != sizeof(TraceRecord))
+    {
+      fprintf(stderr, "%s is not a version %u HDR WSI trace\n", path, s_TraceVersion);
+      return false;
+    }
+
+    uint64_t available = (trace.size - sizeof(TraceHeader)) / sizeof(TraceRecord);
+    trace.header = header;
+    trace.records = reinterpret_cast<const TraceRecord *>(header + 1);
+    trace.total = header->count.load(std::memory_order_relaxed);
+    trace.count = std::min({trace.total, header->capacity, available});
+    return true;
+  }
+}